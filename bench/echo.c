@@ -0,0 +1,205 @@
+/* Echo/RPC Benchmark Server.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ *
+ *   cc -O2 -I.. -o echo echo.c ../el.c ../nio.c -lpthread
+ *   ./echo [-a addr] [-p port] [-n maxfds] [-c]
+ *
+ * Requests are framed as a 4 byte big-endian length followed by the payload
+ * and are answered with the same frame. With -c replies go through the
+ * loop's write coalescer instead of one nio_tcp_nonblock_write per frame.
+ * On SIGINT/SIGTERM the server prints requests served and CPU per request.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "el.h"
+#include "nio.h"
+
+/* -------------------------------- struct ----------------------------------- */
+
+typedef struct echoConn {
+	int len;
+	int cap;
+	char *buf;
+} echoConn;
+
+/* -------------------------------- define ----------------------------------- */
+
+#define ECHO_BUF_SIZE (64 * 1024)
+#define ECHO_MAX_FRAME (16 * 1024 * 1024)
+
+/* -------------------------------- private ---------------------------------- */
+
+static elHandle *_el;
+static nioCoalesce *_nc;
+static long _requests;
+
+static void _echo_stop(int sig);
+static void _echo_free(elHandle *el, void *data);
+static void _echo_close(elHandle *el, int fd);
+static int _echo_reply(int fd, char *buf, int count);
+static void _echo_read(elHandle *el, int fd, void *data, int mask);
+static void _echo_accept(elHandle *el, int fd, void *data, int mask);
+
+/* -------------------------------- private implementation ------------------- */
+
+static void _echo_stop(int sig) {
+	((void)sig);
+	_el->stop = 1;
+}
+
+static void _echo_free(elHandle *el, void *data) {
+	echoConn *c = data;
+	((void)el);
+	free(c->buf);
+	free(c);
+}
+
+static void _echo_close(elHandle *el, int fd) {
+	if( _nc )
+		nio_coalesce_clear(_nc,fd);
+	el_file_del(el,fd,EL_ALLABLE);
+	nio_close(fd);
+}
+
+static int _echo_reply(int fd, char *buf, int count) {
+	if( _nc )
+		return nio_tcp_coalesce_write(NULL,_nc,fd,buf,count);
+	return nio_tcp_nonblock_write(NULL,fd,buf,count);
+}
+
+static void _echo_read(elHandle *el, int fd, void *data, int mask) {
+	echoConn *c = data;
+	int byte, off = 0;
+	((void)mask);
+
+	while( 1 ) {
+		if( c->len == c->cap ) {
+			char *buf = realloc(c->buf,c->cap * 2);
+			if( !buf )
+				goto err;
+			c->buf = buf;
+			c->cap *= 2;
+		}
+		byte = read(fd,c->buf+c->len,c->cap-c->len);
+		if( 0 < byte ) {
+			c->len += byte;
+			continue;
+		}
+		if( !byte )
+			goto err;
+		if( EINTR == errno )
+			continue;
+		if( EAGAIN == errno )
+			break;
+		goto err;
+	}
+
+	while( 4 <= c->len - off ) {
+		uint32_t size;
+		memcpy(&size,c->buf+off,4);
+		size = ntohl(size);
+		if( ECHO_MAX_FRAME < size )
+			goto err;
+		if( 4 + size > (uint32_t)(c->len - off) )
+			break;
+		if( NIO_OK != _echo_reply(fd,c->buf+off,4+size) )
+			goto err;
+		off += 4 + size;
+		_requests++;
+	}
+	c->len -= off;
+	memmove(c->buf,c->buf+off,c->len);
+	return;
+err:
+	_echo_close(el,fd);
+}
+
+static void _echo_accept(elHandle *el, int fd, void *data, int mask) {
+	char err[256];
+	echoConn *ec;
+	int c;
+	((void)data);
+	((void)mask);
+
+	if( NIO_ERR == (c = nio_tcp_accept(err,fd,NULL,0,NULL)) ) {
+		fprintf(stderr,"%s\n",err);
+		return;
+	}
+	nio_enable_tcp_nonblock(NULL,c);
+	nio_enable_tcp_nodelay(NULL,c);
+
+	ec = calloc(1,sizeof(*ec));
+	if( !ec || !(ec->buf = malloc(ECHO_BUF_SIZE)) ) {
+		free(ec);
+		nio_close(c);
+		return;
+	}
+	ec->cap = ECHO_BUF_SIZE;
+	if( EL_ERR == el_file_add(el,c,EL_READABLE|EL_FREEABLE,_echo_read,ec,_echo_free) ) {
+		_echo_free(el,ec);
+		nio_close(c);
+	}
+}
+
+/* -------------------------------- main ------------------------------------- */
+
+int main(int argc, char **argv) {
+	const char *addr = NULL;
+	int port = 7000, size = 65536, coalesce = 0, opt, s;
+	struct rusage ru;
+	char err[256];
+	double cpu;
+
+	while( -1 != (opt = getopt(argc,argv,"a:p:n:c")) ) {
+		switch( opt ) {
+		case 'a': addr = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'n': size = atoi(optarg); break;
+		case 'c': coalesce = 1; break;
+		default:
+			fprintf(stderr,"usage: %s [-a addr] [-p port] [-n maxfds] [-c]\n",argv[0]);
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE,SIG_IGN);
+	signal(SIGINT,_echo_stop);
+	signal(SIGTERM,_echo_stop);
+
+	if( !(_el = el_create(size,100)) ) {
+		fprintf(stderr,"el_create failed\n");
+		return 1;
+	}
+	if( coalesce && !(_nc = nio_coalesce_create(_el)) ) {
+		fprintf(stderr,"nio_coalesce_create failed\n");
+		return 1;
+	}
+	if( NIO_ERR == (s = nio_tcp_server(err,addr,port,1024)) ) {
+		fprintf(stderr,"%s\n",err);
+		return 1;
+	}
+	nio_enable_tcp_nonblock(NULL,s);
+	el_file_add(_el,s,EL_READABLE,_echo_accept,NULL,NULL);
+
+	el_main(_el);
+
+	getrusage(RUSAGE_SELF,&ru);
+	cpu = ru.ru_utime.tv_sec * 1e6 + ru.ru_utime.tv_usec +
+		ru.ru_stime.tv_sec * 1e6 + ru.ru_stime.tv_usec;
+	printf("requests: %ld\ncpu: %.3f s, %.3f us/request\n",
+		_requests,cpu / 1e6,_requests ? cpu / _requests : 0.0);
+
+	nio_close(s);
+	el_destroy(_el);
+	return 0;
+}
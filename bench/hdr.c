@@ -0,0 +1,221 @@
+/* High Dynamic Range Histogram.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hdr.h"
+
+/* -------------------------------- define ----------------------------------- */
+
+#define HDR_FREE(_p) \
+	do { if(_p) { free(_p); _p = NULL; } } while(0)
+
+/* -------------------------------- private ---------------------------------- */
+
+static int _hdr_bucket_index(hdrHandle *h, int64_t value);
+static int _hdr_counts_index(hdrHandle *h, int64_t value);
+static int64_t _hdr_value_at_index(hdrHandle *h, int index);
+static int64_t _hdr_highest_equivalent(hdrHandle *h, int64_t value);
+
+/* -------------------------------- private implementation ------------------- */
+
+static int _hdr_bucket_index(hdrHandle *h, int64_t value) {
+	int pow2ceiling = 64 - __builtin_clzll(value | h->sub_bucket_mask);
+	return pow2ceiling - h->unit_magnitude - (h->sub_bucket_half_count_magnitude + 1);
+}
+
+static int _hdr_counts_index(hdrHandle *h, int64_t value) {
+	int bucket = _hdr_bucket_index(h,value);
+	int sub = (int)(value >> (bucket + h->unit_magnitude));
+	return ((bucket + 1) << h->sub_bucket_half_count_magnitude) + (sub - h->sub_bucket_half_count);
+}
+
+static int64_t _hdr_value_at_index(hdrHandle *h, int index) {
+	int bucket = (index >> h->sub_bucket_half_count_magnitude) - 1;
+	int sub = (index & (h->sub_bucket_half_count - 1)) + h->sub_bucket_half_count;
+
+	if( 0 > bucket ) {
+		sub -= h->sub_bucket_half_count;
+		bucket = 0;
+	}
+	return (int64_t)sub << (bucket + h->unit_magnitude);
+}
+
+static int64_t _hdr_highest_equivalent(hdrHandle *h, int64_t value) {
+	int bucket = _hdr_bucket_index(h,value);
+	int sub = (int)(value >> (bucket + h->unit_magnitude));
+	int adjusted = h->sub_bucket_count <= sub ? bucket + 1 : bucket;
+	int64_t lowest = (int64_t)sub << (bucket + h->unit_magnitude);
+	return lowest + ((int64_t)1 << (h->unit_magnitude + adjusted)) - 1;
+}
+
+/* -------------------------------- api implementation ----------------------- */
+
+hdrHandle *hdr_create(int64_t lowest, int64_t highest, int digits) {
+	hdrHandle *h;
+	int64_t largest, smallest;
+
+	if( 1 > lowest || lowest * 2 > highest || 1 > digits || 5 < digits )
+		return NULL;
+	h = calloc(1,sizeof(*h));
+	if( !h )
+		return NULL;
+
+	h->lowest = lowest;
+	h->highest = highest;
+	h->digits = digits;
+	h->unit_magnitude = (int)floor(log2((double)lowest));
+
+	largest = 2 * (int64_t)pow(10,digits);
+	h->sub_bucket_half_count_magnitude = (int)ceil(log2((double)largest)) - 1;
+	h->sub_bucket_count = 1 << (h->sub_bucket_half_count_magnitude + 1);
+	h->sub_bucket_half_count = h->sub_bucket_count / 2;
+	h->sub_bucket_mask = ((int64_t)h->sub_bucket_count - 1) << h->unit_magnitude;
+
+	smallest = (int64_t)h->sub_bucket_count << h->unit_magnitude;
+	h->bucket_count = 1;
+	while( smallest <= highest ) {
+		if( INT64_MAX / 2 < smallest ) {
+			h->bucket_count++;
+			break;
+		}
+		smallest <<= 1;
+		h->bucket_count++;
+	}
+	h->counts_len = (h->bucket_count + 1) * h->sub_bucket_half_count;
+
+	h->counts = calloc(h->counts_len,sizeof(*h->counts));
+	if( !h->counts ) {
+		HDR_FREE(h);
+		return NULL;
+	}
+	hdr_reset(h);
+	return h;
+}
+
+void hdr_destroy(hdrHandle *h) {
+	HDR_FREE(h->counts);
+	HDR_FREE(h);
+}
+
+void hdr_reset(hdrHandle *h) {
+	memset(h->counts,0,h->counts_len*sizeof(*h->counts));
+	h->total = 0;
+	h->min = INT64_MAX;
+	h->max = 0;
+}
+
+int hdr_record(hdrHandle *h, int64_t value) {
+	int index;
+
+	if( 0 > value )
+		return HDR_ERR;
+	index = _hdr_counts_index(h,value);
+	if( 0 > index || h->counts_len <= index )
+		return HDR_ERR;
+	h->counts[index]++;
+	h->total++;
+	if( value < h->min && value )
+		h->min = value;
+	if( value > h->max )
+		h->max = value;
+	return HDR_OK;
+}
+
+int hdr_add(hdrHandle *h, hdrHandle *from) {
+	int i;
+
+	if( h->counts_len != from->counts_len || h->unit_magnitude != from->unit_magnitude )
+		return HDR_ERR;
+	for( i = 0; h->counts_len > i; ++i )
+		h->counts[i] += from->counts[i];
+	h->total += from->total;
+	if( from->min < h->min )
+		h->min = from->min;
+	if( from->max > h->max )
+		h->max = from->max;
+	return HDR_OK;
+}
+
+int64_t hdr_value_at_percentile(hdrHandle *h, double percentile) {
+	int64_t count, total = 0;
+	int i;
+
+	if( 100.0 < percentile )
+		percentile = 100.0;
+	count = (int64_t)ceil(percentile / 100.0 * h->total);
+	if( 1 > count )
+		count = 1;
+	for( i = 0; h->counts_len > i; ++i ) {
+		total += h->counts[i];
+		if( total >= count )
+			return _hdr_highest_equivalent(h,_hdr_value_at_index(h,i));
+	}
+	return 0;
+}
+
+double hdr_mean(hdrHandle *h) {
+	double total = 0;
+	int i;
+
+	if( !h->total )
+		return 0;
+	for( i = 0; h->counts_len > i; ++i ) {
+		if( h->counts[i] ) {
+			int64_t v = _hdr_value_at_index(h,i);
+			total += h->counts[i] * (double)((v + _hdr_highest_equivalent(h,v)) / 2);
+		}
+	}
+	return total / h->total;
+}
+
+double hdr_stddev(hdrHandle *h) {
+	double mean = hdr_mean(h), total = 0;
+	int i;
+
+	if( !h->total )
+		return 0;
+	for( i = 0; h->counts_len > i; ++i ) {
+		if( h->counts[i] ) {
+			int64_t v = _hdr_value_at_index(h,i);
+			double dev = (double)((v + _hdr_highest_equivalent(h,v)) / 2) - mean;
+			total += dev * dev * h->counts[i];
+		}
+	}
+	return sqrt(total / h->total);
+}
+
+/* Prints the percentile distribution in the .hgrm text layout understood by
+ * the HdrHistogram plotter; values are divided by scale. */
+void hdr_print(hdrHandle *h, FILE *fp, int ticks, double scale) {
+	double percentile = 0, remaining;
+	int step = 0;
+
+	fprintf(fp,"%12s %14s %10s %14s\n\n","Value","Percentile","TotalCount","1/(1-Percentile)");
+	while( h->total ) {
+		int64_t value = hdr_value_at_percentile(h,percentile);
+		int64_t count = 0;
+		int i;
+
+		for( i = 0; h->counts_len > i && _hdr_value_at_index(h,i) <= value; ++i )
+			count += h->counts[i];
+		if( 100.0 > percentile )
+			fprintf(fp,"%12.3f %2.12f %10lld %14.2f\n",value / scale,percentile / 100.0,
+				(long long)count,1.0 / (1.0 - percentile / 100.0));
+		else
+			fprintf(fp,"%12.3f %2.12f %10lld\n",value / scale,1.0,(long long)count);
+		if( 100.0 <= percentile )
+			break;
+		remaining = 100.0 / pow(2.0,(double)++step / ticks);
+		percentile = 100.0 - remaining;
+		if( count >= h->total || 1.0 > remaining * h->total / 100.0 )
+			percentile = 100.0;
+	}
+	fprintf(fp,"#[Mean    = %12.3f, StdDeviation   = %12.3f]\n",hdr_mean(h) / scale,hdr_stddev(h) / scale);
+	fprintf(fp,"#[Max     = %12.3f, Total count    = %12lld]\n",h->max / scale,(long long)h->total);
+	fprintf(fp,"#[Buckets = %12d, SubBuckets     = %12d]\n",h->bucket_count,h->sub_bucket_count);
+}
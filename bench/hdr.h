@@ -0,0 +1,56 @@
+/* High Dynamic Range Histogram.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ */
+
+#ifndef __HDR_H_
+#define __HDR_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* -------------------------------- struct ----------------------------------- */
+
+typedef struct hdrHandle {
+	int64_t lowest;
+	int64_t highest;
+	int digits;
+	int unit_magnitude;
+	int sub_bucket_half_count_magnitude;
+	int sub_bucket_count;
+	int sub_bucket_half_count;
+	int64_t sub_bucket_mask;
+	int bucket_count;
+	int counts_len;
+	int64_t total;
+	int64_t min;
+	int64_t max;
+	int64_t *counts;
+} hdrHandle;
+
+/* -------------------------------- define ----------------------------------- */
+
+#define HDR_OK 0
+#define HDR_ERR -1
+
+/* -------------------------------- api functions ---------------------------- */
+
+hdrHandle *hdr_create(int64_t lowest, int64_t highest, int digits);
+void hdr_destroy(hdrHandle *h);
+void hdr_reset(hdrHandle *h);
+int hdr_record(hdrHandle *h, int64_t value);
+int hdr_add(hdrHandle *h, hdrHandle *from);
+int64_t hdr_value_at_percentile(hdrHandle *h, double percentile);
+double hdr_mean(hdrHandle *h);
+double hdr_stddev(hdrHandle *h);
+void hdr_print(hdrHandle *h, FILE *fp, int ticks, double scale);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HDR_H_ */
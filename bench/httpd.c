@@ -0,0 +1,88 @@
+/* HTTP/1.1 Benchmark Server.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ *
+ *   cc -O2 -I.. -o httpd httpd.c ../http.c ../el.c ../nio.c -lpthread
+ *   ./httpd [-a addr] [-p port] [-n maxfds]
+ *
+ * Answers every request with its own body, so loadgen -m http measures the
+ * HTTP module against the same workload echo.c serves with raw frames.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "el.h"
+#include "http.h"
+
+/* -------------------------------- private ---------------------------------- */
+
+static elHandle *_el;
+
+static void _httpd_stop(int sig);
+static void _httpd_request(httpHandle *hh, httpRequest *req, void *data);
+
+/* -------------------------------- private implementation ------------------- */
+
+static void _httpd_stop(int sig) {
+	((void)sig);
+	_el->stop = 1;
+}
+
+static void _httpd_request(httpHandle *hh, httpRequest *req, void *data) {
+	((void)data);
+	http_response(hh,req,200,"Content-Type: application/octet-stream\r\n",
+		req->body.p,req->body.len);
+}
+
+/* -------------------------------- main ------------------------------------- */
+
+int main(int argc, char **argv) {
+	const char *addr = NULL;
+	int port = 8080, size = 65536, opt;
+	struct rusage ru;
+	httpHandle *hh;
+	char err[256];
+	double cpu;
+	long requests;
+
+	while( -1 != (opt = getopt(argc,argv,"a:p:n:")) ) {
+		switch( opt ) {
+		case 'a': addr = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'n': size = atoi(optarg); break;
+		default:
+			fprintf(stderr,"usage: %s [-a addr] [-p port] [-n maxfds]\n",argv[0]);
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE,SIG_IGN);
+	signal(SIGINT,_httpd_stop);
+	signal(SIGTERM,_httpd_stop);
+
+	if( !(_el = el_create(size,100)) ) {
+		fprintf(stderr,"el_create failed\n");
+		return 1;
+	}
+	if( !(hh = http_server(err,_el,addr,port,_httpd_request,NULL)) ) {
+		fprintf(stderr,"%s\n",err);
+		return 1;
+	}
+
+	el_main(_el);
+
+	requests = hh->requests;
+	getrusage(RUSAGE_SELF,&ru);
+	cpu = ru.ru_utime.tv_sec * 1e6 + ru.ru_utime.tv_usec +
+		ru.ru_stime.tv_sec * 1e6 + ru.ru_stime.tv_usec;
+	printf("requests: %ld\ncpu: %.3f s, %.3f us/request\n",
+		requests,cpu / 1e6,requests ? cpu / requests : 0.0);
+
+	http_destroy(hh);
+	el_destroy(_el);
+	return 0;
+}
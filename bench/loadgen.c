@@ -0,0 +1,429 @@
+/* Open-Loop Load Generator.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ *
+ *   cc -O2 -I.. -o loadgen loadgen.c hdr.c ../el.c ../nio.c -lpthread -lm
+ *   ./loadgen [-a addr] [-p port] [-t threads] [-c conns] [-r rate]
+ *             [-s size] [-d depth] [-D seconds] [-m echo|http] [-H]
+ *
+ * Sends echo frames (see echo.c), or with -m http POST requests carrying the
+ * same payload (see httpd.c), at a fixed total rate spread over threads
+ * and connections, each connection allowing up to depth requests in flight.
+ * Every request has an intended send time on a fixed schedule and latency is
+ * measured from that time, not from when the request actually left, so
+ * stalls on the server or in the generator are charged to the requests they
+ * delayed (coordinated-omission correction). -H prints the full percentile
+ * distribution in HdrHistogram .hgrm layout, in microseconds.
+ *
+ * Sends are paced with a timerfd armed for the next intended time, so the
+ * generator sleeps between requests instead of polling. The CPU figure it
+ * prints is the generator's own; the server's CPU per request is what
+ * echo and httpd print when they exit.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "el.h"
+#include "hdr.h"
+#include "nio.h"
+
+/* -------------------------------- struct ----------------------------------- */
+
+typedef struct genConn {
+	struct genThread *gt;
+	int fd;
+	int len;
+	int cap;
+	int head;
+	int num;
+	char *buf;
+	int64_t *sent;
+} genConn;
+
+typedef struct genThread {
+	pthread_t tid;
+	int tfd;
+	int nconn;
+	int next_conn;
+	int64_t interval;
+	int64_t next;
+	int64_t end;
+	int64_t begin;
+	int64_t finish;
+	long sent;
+	long received;
+	long errors;
+	long failed;
+	genConn *conns;
+	elHandle *el;
+	nioCoalesce *nc;
+	hdrHandle *hist;
+} genThread;
+
+/* -------------------------------- define ----------------------------------- */
+
+#define GEN_BUF_SIZE (64 * 1024)
+#define GEN_HIGHEST (60LL * 1000 * 1000 * 1000)
+#define GEN_DRAIN (2LL * 1000 * 1000 * 1000)
+#define GEN_HEADER 256
+
+#define GEN_MODE_ECHO 0
+#define GEN_MODE_HTTP 1
+
+/* -------------------------------- private ---------------------------------- */
+
+static const char *_addr = "127.0.0.1";
+static int _port = 7000;
+static int _size = 64;
+static int _depth = 1;
+static int _mode = GEN_MODE_ECHO;
+static int _frame_len;
+static char *_frame;
+
+static int64_t _gen_now(void);
+static int _gen_response(char *buf, int len);
+static void _gen_close(genThread *gt, genConn *c);
+static void _gen_read(elHandle *el, int fd, void *data, int mask);
+static void _gen_arm(genThread *gt, int64_t when);
+static void _gen_tick(elHandle *el, int fd, void *data, int mask);
+static int _gen_issue(elHandle *el, long id, void *data);
+static void *_gen_thread(void *arg);
+
+/* -------------------------------- private implementation ------------------- */
+
+static int64_t _gen_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Returns the length of the complete response at buf, or 0. */
+static int _gen_response(char *buf, int len) {
+	uint32_t size;
+	char *p, *end;
+
+	if( GEN_MODE_ECHO == _mode ) {
+		if( 4 > len )
+			return 0;
+		memcpy(&size,buf,4);
+		size = ntohl(size);
+		return 4 + size <= (uint32_t)len ? (int)(4 + size) : 0;
+	}
+
+	if( !(end = memmem(buf,len,"\r\n\r\n",4)) )
+		return 0;
+	end += 4;
+	size = 0;
+	if( (p = memmem(buf,end-buf,"Content-Length:",15)) ) {
+		for( p += 15; ' ' == *p; ++p )
+			;
+		for( ; '0' <= *p && '9' >= *p; ++p )
+			size = size * 10 + *p - '0';
+	}
+	return end - buf + size <= (uint32_t)len ? (int)(end - buf + size) : 0;
+}
+
+static void _gen_close(genThread *gt, genConn *c) {
+	gt->errors += c->num;
+	c->num = 0;
+	nio_coalesce_clear(gt->nc,c->fd);
+	el_file_del(gt->el,c->fd,EL_ALLABLE);
+	nio_close(c->fd);
+	c->fd = NIO_INV;
+}
+
+static void _gen_read(elHandle *el, int fd, void *data, int mask) {
+	genConn *c = data;
+	genThread *gt = c->gt;
+	int byte, off = 0;
+	int64_t now;
+	((void)el);
+	((void)mask);
+
+	while( 1 ) {
+		byte = read(fd,c->buf+c->len,c->cap-c->len);
+		if( 0 < byte ) {
+			c->len += byte;
+			if( c->len == c->cap )
+				break;
+			continue;
+		}
+		if( !byte || (EINTR != errno && EAGAIN != errno) ) {
+			_gen_close(gt,c);
+			return;
+		}
+		if( EAGAIN == errno )
+			break;
+	}
+
+	now = _gen_now();
+	while( c->num ) {
+		int size = _gen_response(c->buf+off,c->len-off);
+		if( !size )
+			break;
+		hdr_record(gt->hist,now - c->sent[c->head]);
+		c->head = (c->head + 1) % _depth;
+		c->num--;
+		gt->received++;
+		off += size;
+	}
+	c->len -= off;
+	memmove(c->buf,c->buf+off,c->len);
+}
+
+static void _gen_arm(genThread *gt, int64_t when) {
+	struct itimerspec its;
+
+	memset(&its,0,sizeof(its));
+	its.it_value.tv_sec = when / 1000000000;
+	its.it_value.tv_nsec = when % 1000000000;
+	timerfd_settime(gt->tfd,TFD_TIMER_ABSTIME,&its,NULL);
+}
+
+/* Only wakes the loop; the wait hook issues what has come due. */
+static void _gen_tick(elHandle *el, int fd, void *data, int mask) {
+	uint64_t expired;
+	ssize_t byte = read(fd,&expired,sizeof(expired));
+	((void)el);
+	((void)data);
+	((void)mask);
+	((void)byte);
+}
+
+/* Issues every request whose intended time has passed, just before the loop
+ * waits, then arms the timerfd for the next one. */
+static int _gen_issue(elHandle *el, long id, void *data) {
+	genThread *gt = data;
+	int64_t now = _gen_now();
+	int i, inflight = 0;
+	((void)id);
+
+	while( gt->next <= now && gt->next < gt->end && now < gt->end ) {
+		genConn *c = NULL;
+
+		for( i = 0; gt->nconn > i; ++i ) {
+			genConn *p = &gt->conns[(gt->next_conn + i) % gt->nconn];
+			if( NIO_INV != p->fd && _depth > p->num ) {
+				c = p;
+				break;
+			}
+		}
+		if( !c )
+			break;
+		gt->next_conn = (gt->next_conn + i + 1) % gt->nconn;
+
+		if( NIO_OK != nio_tcp_coalesce_write(NULL,gt->nc,c->fd,_frame,_frame_len) ) {
+			_gen_close(gt,c);
+			continue;
+		}
+		c->sent[(c->head + c->num) % _depth] = gt->next;
+		c->num++;
+		gt->sent++;
+		gt->next += gt->interval;
+	}
+
+	if( gt->next >= gt->end || now >= gt->end ) {
+		for( i = 0; gt->nconn > i; ++i )
+			inflight += gt->conns[i].num;
+		if( !inflight || now >= gt->end + GEN_DRAIN ) {
+			/* Skip the wait this iteration would otherwise block in. */
+			el->stop = 1;
+			return 1;
+		}
+		_gen_arm(gt,gt->end + GEN_DRAIN);
+		return 0;
+	}
+	_gen_arm(gt,gt->next);
+	return 0;
+}
+
+static void *_gen_thread(void *arg) {
+	genThread *gt = arg;
+	char err[256];
+	int i;
+
+	for( i = 0; gt->nconn > i; ++i ) {
+		genConn *c = &gt->conns[i];
+
+		c->fd = nio_tcp_connect(err,_addr,_port);
+		if( NIO_ERR == c->fd ) {
+			fprintf(stderr,"connect: %s\n",err);
+			gt->failed++;
+			continue;
+		}
+		nio_enable_tcp_nonblock(NULL,c->fd);
+		nio_enable_tcp_nodelay(NULL,c->fd);
+		if( EL_ERR == el_file_add(gt->el,c->fd,EL_READABLE,_gen_read,c,NULL) ) {
+			fprintf(stderr,"el_file_add: fd %d does not fit the loop\n",c->fd);
+			nio_close(c->fd);
+			c->fd = NIO_INV;
+			gt->failed++;
+		}
+	}
+
+	gt->tfd = timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC);
+	if( NIO_ERR == gt->tfd ) {
+		fprintf(stderr,"timerfd: %s\n",strerror(errno));
+	} else if( EL_ERR == el_file_add(gt->el,gt->tfd,EL_READABLE,_gen_tick,gt,NULL) ) {
+		fprintf(stderr,"el_file_add: timerfd %d does not fit the loop\n",gt->tfd);
+	} else {
+		gt->begin = gt->next = _gen_now();
+		gt->end += gt->next;
+		el_wait_add(gt->el,_gen_issue,gt,NULL);
+		el_main(gt->el);
+		gt->finish = _gen_now();
+		el_file_del(gt->el,gt->tfd,EL_READABLE);
+	}
+	if( NIO_ERR != gt->tfd )
+		nio_close(gt->tfd);
+
+	for( i = 0; gt->nconn > i; ++i ) {
+		if( NIO_INV != gt->conns[i].fd )
+			_gen_close(gt,&gt->conns[i]);
+	}
+	return NULL;
+}
+
+/* -------------------------------- main ------------------------------------- */
+
+int main(int argc, char **argv) {
+	int threads = 1, conns = 1, print = 0, opt, i, j;
+	double rate = 1000, seconds = 10, elapsed, cpu;
+	long sent = 0, received = 0, errors = 0, failed = 0;
+	struct rusage ru0, ru1;
+	int64_t begin = 0, finish = 0;
+	genThread *gts;
+	hdrHandle *hist;
+	uint32_t size;
+
+	while( -1 != (opt = getopt(argc,argv,"a:p:t:c:r:s:d:D:m:H")) ) {
+		switch( opt ) {
+		case 'a': _addr = optarg; break;
+		case 'p': _port = atoi(optarg); break;
+		case 't': threads = atoi(optarg); break;
+		case 'c': conns = atoi(optarg); break;
+		case 'r': rate = atof(optarg); break;
+		case 's': _size = atoi(optarg); break;
+		case 'd': _depth = atoi(optarg); break;
+		case 'D': seconds = atof(optarg); break;
+		case 'm': _mode = strcmp(optarg,"http") ? GEN_MODE_ECHO : GEN_MODE_HTTP; break;
+		case 'H': print = 1; break;
+		default:
+			fprintf(stderr,"usage: %s [-a addr] [-p port] [-t threads] [-c conns] [-r rate] "
+				"[-s size] [-d depth] [-D seconds] [-m echo|http] [-H]\n",argv[0]);
+			return 1;
+		}
+	}
+	if( 1 > threads || threads > conns || 0 >= rate || 0 > _size || 1 > _depth ) {
+		fprintf(stderr,"invalid options\n");
+		return 1;
+	}
+
+	signal(SIGPIPE,SIG_IGN);
+
+	_frame = calloc(1,GEN_HEADER+_size);
+	if( GEN_MODE_ECHO == _mode ) {
+		size = htonl(_size);
+		memcpy(_frame,&size,4);
+		_frame_len = 4 + _size;
+	} else {
+		_frame_len = snprintf(_frame,GEN_HEADER,"POST / HTTP/1.1\r\nHost: %s\r\n"
+			"Content-Length: %d\r\n\r\n",_addr,_size) + _size;
+	}
+
+	hist = hdr_create(1,GEN_HIGHEST,3);
+	gts = calloc(threads,sizeof(*gts));
+	for( i = 0; threads > i; ++i ) {
+		genThread *gt = &gts[i];
+
+		gt->nconn = conns / threads + (conns % threads > i);
+		gt->conns = calloc(gt->nconn,sizeof(*gt->conns));
+		for( j = 0; gt->nconn > j; ++j ) {
+			gt->conns[j].gt = gt;
+			gt->conns[j].fd = NIO_INV;
+			gt->conns[j].cap = GEN_BUF_SIZE > GEN_HEADER + _size ? GEN_BUF_SIZE : 2 * (GEN_HEADER + _size);
+			gt->conns[j].buf = malloc(gt->conns[j].cap);
+			gt->conns[j].sent = calloc(_depth,sizeof(int64_t));
+		}
+		gt->interval = (int64_t)(1e9 * threads / rate);
+		if( 1 > gt->interval )
+			gt->interval = 1;
+		gt->end = (int64_t)(seconds * 1e9);
+		/* fd numbers are shared by every thread, so each loop must be
+		 * able to hold any fd the process opens. */
+		gt->el = el_create(conns + 1024,0);
+		gt->nc = nio_coalesce_create(gt->el);
+		gt->hist = hdr_create(1,GEN_HIGHEST,3);
+	}
+
+	getrusage(RUSAGE_SELF,&ru0);
+	for( i = 0; threads > i; ++i )
+		pthread_create(&gts[i].tid,NULL,_gen_thread,&gts[i]);
+	for( i = 0; threads > i; ++i ) {
+		genThread *gt = &gts[i];
+
+		pthread_join(gt->tid,NULL);
+		hdr_add(hist,gt->hist);
+		sent += gt->sent;
+		received += gt->received;
+		errors += gt->errors;
+		failed += gt->failed;
+		if( gt->begin && (!begin || begin > gt->begin) )
+			begin = gt->begin;
+		if( finish < gt->finish )
+			finish = gt->finish;
+	}
+	/* From the first scheduled send to the last drained response, so the
+	 * time spent connecting does not dilute the throughput. */
+	elapsed = begin < finish ? (finish - begin) / 1e9 : 0;
+	getrusage(RUSAGE_SELF,&ru1);
+	cpu = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec) * 1e6 + (ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec) +
+		(ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec) * 1e6 + (ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec);
+
+	printf("target: %s %.0f req/s, %d threads, %d conns, %d bytes, depth %d\n",
+		GEN_MODE_ECHO == _mode ? "echo" : "http",rate,threads,conns,_size,_depth);
+	printf("connections: %d opened, %ld failed\n",conns - (int)failed,failed);
+	printf("requests: %ld sent, %ld received, %ld errors in %.3f s\n",
+		sent,received,errors,elapsed);
+	printf("throughput: %.0f req/s\n",elapsed ? received / elapsed : 0.0);
+	printf("latency (us): p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f p99.99 %.1f max %.1f\n",
+		hdr_value_at_percentile(hist,50) / 1e3,
+		hdr_value_at_percentile(hist,90) / 1e3,
+		hdr_value_at_percentile(hist,99) / 1e3,
+		hdr_value_at_percentile(hist,99.9) / 1e3,
+		hdr_value_at_percentile(hist,99.99) / 1e3,
+		hist->max / 1e3);
+	printf("cpu: %.3f us/request of generator CPU (server CPU is printed by echo/httpd on exit)\n",
+		received ? cpu / received : 0.0);
+	if( print )
+		hdr_print(hist,stdout,5,1e3);
+
+	for( i = 0; threads > i; ++i ) {
+		genThread *gt = &gts[i];
+
+		el_destroy(gt->el);
+		hdr_destroy(gt->hist);
+		for( j = 0; gt->nconn > j; ++j ) {
+			free(gt->conns[j].buf);
+			free(gt->conns[j].sent);
+		}
+		free(gt->conns);
+	}
+	free(gts);
+	hdr_destroy(hist);
+	free(_frame);
+	return 0;
+}
@@ -4,11 +4,15 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "el.h"
@@ -20,6 +24,49 @@ typedef struct epHandle {
 	struct epoll_event *events;
 } epHandle;
 
+typedef struct elWork {
+	el_work_proc work_proc;
+	el_done_proc done_proc;
+	void *data;
+	long queued;
+	struct elWork *next;
+} elWork;
+
+typedef struct elWorker {
+	pthread_t tid;
+	pthread_mutex_t lock;
+	int head;
+	int num;
+	elWork **ring;
+	struct elWorks *works;
+} elWorker;
+
+typedef struct elWorks {
+	int fd;
+	int stop;
+	int depth;
+	int next;
+	int queued;
+	int threads;
+	elWorker *workers;
+	elWork *dones;
+	elWork *tail;
+	elWorkStats stats;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} elWorks;
+
+/* Ring owned by the loop thread: it both appends and dumps, so neither
+ * needs a lock. */
+typedef struct elTrace {
+	unsigned long mask;
+	unsigned long head;
+	unsigned long dumped;
+	long long slow;
+	int fd;
+	elTraceRecord *records;
+} elTrace;
+
 /* -------------------------------- define ----------------------------------- */
 
 #define	EL_INV -1
@@ -45,6 +92,20 @@ static void _el_time_clear(elHandle *el);
 static void *_el_time_search(elHandle *el);
 static int _el_time_process(elHandle *el);
 
+static void _el_wait_clear(elHandle *el);
+static int _el_wait_process(elHandle *el);
+
+static long _el_work_now(void);
+static elWork *_el_work_take(elWorks *ws, int self);
+static void *_el_work_thread(void *arg);
+static void _el_work_deliver(elHandle *el, int fd, void *data, int mask);
+static void _el_work_destroy(elHandle *el);
+
+static long long _el_trace_now(void);
+static void _el_trace_add(elTrace *tr, int type, long long id, int mask, long long ts, long long dur);
+static int _el_trace_write(int fd, const void *buf, size_t len);
+static void _el_trace_destroy(elHandle *el);
+
 static int _el_process(elHandle *el);
 
 /* -------------------------------- private implementation ------------------- */
@@ -172,11 +233,12 @@ static void _el_time_clear(elHandle *el) {
 	elTimeEvent *te = el->times, *tp;
 	while( te ) {
 		tp = te;
+		te = te->next;
 		if( tp->free_proc )
 			tp->free_proc(el,tp->data);
 		EL_FREE(tp);
-		te = te->next;
 	}
+	el->times = NULL;
 }
 
 static void *_el_time_search(elHandle *el) {
@@ -190,43 +252,266 @@ static void *_el_time_search(elHandle *el) {
 	return nearest;
 }
 
+/* Due timers are marked first and then fired one at a time from the live
+ * list, so a callback can el_time_del any of them before it runs, and
+ * timers added by a callback wait for the next iteration. */
 static int _el_time_process(elHandle *el) {
-	elTimeEvent *te = el->times, *tp = NULL;
+	elTimeEvent *tp;
+	long sc = 0, ms = 0;
 	int processed = 0;
 
-	while( te ) {
-		long sc = 0, ms = 0;
+	_el_time_get(&sc,&ms);
+
+	for( tp = el->times; tp; tp = tp->next )
+		tp->due = sc > tp->sc || (sc == tp->sc && ms >= tp->ms);
+
+	for( ;; ) {
+		for( tp = el->times; tp && !tp->due; tp = tp->next );
+		if( !tp )
+			break;
+		if( tp->prev )
+			tp->prev->next = tp->next;
+		else
+			el->times = tp->next;
+		if( tp->next )
+			tp->next->prev = tp->prev;
+		if( tp->time_proc && el->trace ) {
+			long long ts = _el_trace_now();
+			tp->time_proc(el,tp->id,tp->data);
+			_el_trace_add(el->trace,EL_TRACE_TIME,tp->id,0,ts,_el_trace_now()-ts);
+		} else if( tp->time_proc ) {
+			tp->time_proc(el,tp->id,tp->data);
+		}
+		if( tp->free_proc )
+			tp->free_proc(el,tp->data);
+		EL_FREE(tp);
+		processed++;
+	}
+	return processed;
+}
 
-		_el_time_get(&sc,&ms);
+static void _el_wait_clear(elHandle *el) {
+	elWaitEvent *we = el->waits, *wp;
+	while( we ) {
+		wp = we;
+		we = we->next;
+		if( wp->free_proc )
+			wp->free_proc(el,wp->data);
+		EL_FREE(wp);
+	}
+	el->waits = NULL;
+}
 
-		if( sc > te->sc ||
-			(sc == te->sc && ms >= te->ms) ) {
-			if( te->prev )
-				te->prev->next = te->next;
-			else
-				el->times = te->next;
-			if( te->next )
-				te->next->prev = te->prev;
-			tp = te;
+static int _el_wait_process(elHandle *el) {
+	elWaitEvent *we = el->waits, *wn;
+	int pending = 0;
+
+	while( we ) {
+		wn = we->next;
+		if( we->wait_proc )
+			pending += we->wait_proc(el,we->id,we->data);
+		we = wn;
+	}
+	return pending;
+}
+
+static long _el_work_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Pops the oldest work of the worker's own ring, or steals the newest one
+ * from a sibling when its own ring is empty. */
+static elWork *_el_work_take(elWorks *ws, int self) {
+	elWork *w = NULL;
+	int i;
+
+	for( i = 0; ws->threads > i && !w; ++i ) {
+		elWorker *wk = &ws->workers[(self + i) % ws->threads];
+
+		pthread_mutex_lock(&wk->lock);
+		if( wk->num ) {
+			if( !i ) {
+				w = wk->ring[wk->head];
+				wk->head = (wk->head + 1) % ws->depth;
+			} else {
+				w = wk->ring[(wk->head + wk->num - 1) % ws->depth];
+			}
+			wk->num--;
 		}
+		pthread_mutex_unlock(&wk->lock);
+	}
+	return w;
+}
 
-		if( tp ) {
-			if( tp->time_proc )
-				tp->time_proc(el,tp->id,tp->data);
-			if( tp->free_proc )
-				tp->free_proc(el,tp->data);
-			EL_FREE(tp);
-			processed++;
+static void *_el_work_thread(void *arg) {
+	elWorker *wk = arg;
+	elWorks *ws = wk->works;
+	int self = wk - ws->workers;
+	uint64_t one = 1;
+
+	while( 1 ) {
+		elWork *w;
+		long start, wait, run;
+
+		pthread_mutex_lock(&ws->lock);
+		while( !ws->queued && !ws->stop )
+			pthread_cond_wait(&ws->cond,&ws->lock);
+		if( ws->stop ) {
+			pthread_mutex_unlock(&ws->lock);
+			break;
 		}
-		te = te->next;
+		ws->queued--;
+		pthread_mutex_unlock(&ws->lock);
+
+		while( !(w = _el_work_take(ws,self)) )
+			;
+
+		start = _el_work_now();
+		if( w->work_proc )
+			w->work_proc(w->data);
+		run = _el_work_now() - start;
+		wait = start - w->queued;
+
+		pthread_mutex_lock(&ws->lock);
+		ws->stats.depth--;
+		ws->stats.completed++;
+		ws->stats.wait_us += wait;
+		ws->stats.run_us += run;
+		if( wait > ws->stats.max_wait_us )
+			ws->stats.max_wait_us = wait;
+		if( run > ws->stats.max_run_us )
+			ws->stats.max_run_us = run;
+		w->next = NULL;
+		if( ws->tail )
+			ws->tail->next = w;
+		else
+			ws->dones = w;
+		ws->tail = w;
+		pthread_mutex_unlock(&ws->lock);
+
+		while( sizeof(one) != write(ws->fd,&one,sizeof(one)) && EINTR == errno )
+			;
 	}
-	return processed;
+	return NULL;
+}
+
+static void _el_work_deliver(elHandle *el, int fd, void *data, int mask) {
+	elWorks *ws = data;
+	elWork *w, *wn;
+	uint64_t count;
+	((void)mask);
+
+	while( EL_ERR == read(fd,&count,sizeof(count)) && EINTR == errno )
+		;
+
+	pthread_mutex_lock(&ws->lock);
+	w = ws->dones;
+	ws->dones = ws->tail = NULL;
+	pthread_mutex_unlock(&ws->lock);
+
+	while( w ) {
+		wn = w->next;
+		if( w->done_proc )
+			w->done_proc(el,w->data);
+		EL_FREE(w);
+		w = wn;
+	}
+}
+
+/* Stops the workers once their current work returns. Work still queued or
+ * not yet delivered is dropped without calling its done_proc. */
+static void _el_work_destroy(elHandle *el) {
+	elWorks *ws = el->works;
+	elWork *w;
+	int i;
+
+	if( !ws )
+		return;
+
+	pthread_mutex_lock(&ws->lock);
+	ws->stop = 1;
+	pthread_cond_broadcast(&ws->cond);
+	pthread_mutex_unlock(&ws->lock);
+
+	for( i = 0; ws->threads > i; ++i ) {
+		elWorker *wk = &ws->workers[i];
+		pthread_join(wk->tid,NULL);
+		while( wk->num ) {
+			EL_FREE(wk->ring[wk->head]);
+			wk->head = (wk->head + 1) % ws->depth;
+			wk->num--;
+		}
+		pthread_mutex_destroy(&wk->lock);
+		EL_FREE(wk->ring);
+	}
+	while( (w = ws->dones) ) {
+		ws->dones = w->next;
+		EL_FREE(w);
+	}
+
+	el_file_del(el,ws->fd,EL_READABLE);
+	EL_CLOSE(ws->fd);
+	pthread_cond_destroy(&ws->cond);
+	pthread_mutex_destroy(&ws->lock);
+	EL_FREE(ws->workers);
+	EL_FREE(ws);
+	el->works = NULL;
+}
+
+static long long _el_trace_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void _el_trace_add(elTrace *tr, int type, long long id, int mask, long long ts, long long dur) {
+	unsigned long head = tr->head;
+	elTraceRecord *r = &tr->records[head & tr->mask];
+
+	r->ts = ts;
+	r->id = id;
+	r->dur = 0x7fffffffLL < dur ? 0x7fffffff : (int)dur;
+	r->type = type;
+	r->mask = mask;
+	tr->head = head + 1;
+}
+
+/* Writes all of buf, so a dump never stops partway through a record. */
+static int _el_trace_write(int fd, const void *buf, size_t len) {
+	const char *p = buf;
+
+	while( len ) {
+		ssize_t byte = write(fd,p,len);
+		if( 0 > byte ) {
+			if( EINTR == errno )
+				continue;
+			return EL_ERR;
+		}
+		p += byte;
+		len -= byte;
+	}
+	return EL_OK;
+}
+
+static void _el_trace_destroy(elHandle *el) {
+	elTrace *tr = el->trace;
+	if( !tr )
+		return;
+	EL_FREE(tr->records);
+	EL_FREE(tr);
+	el->trace = NULL;
 }
 
 static int _el_process(elHandle *el) {
 	elTimeEvent *te;
+	elTrace *tr = el->trace;
 	struct timeval tv, *ptv = NULL;
-	int processed, i;
+	long long start = 0, ts = 0;
+	int processed, pending, i;
+
+	pending = _el_wait_process(el);
 
 	te = _el_time_search(el);
 	if( te ) {
@@ -250,19 +535,40 @@ static int _el_process(elHandle *el) {
 			ptv = &tv;
 		}
 	}
+	if( 0 < pending ) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		ptv = &tv;
+	}
 
+	if( tr )
+		_el_trace_add(tr,EL_TRACE_ENTER,ptv ? ptv->tv_sec * 1000 + ptv->tv_usec / 1000 : -1,
+			0,_el_trace_now(),0);
 	processed = _el_epoll(el,ptv);
+	if( tr ) {
+		start = _el_trace_now();
+		_el_trace_add(tr,EL_TRACE_EXIT,processed,0,start,0);
+	}
 	for( i = 0; processed > i; ++i ) {
 		elFileEvent *fe = &el->files[el->trigs[i].fd];
 		int mask = el->trigs[i].mask;
 		int fd = el->trigs[i].fd;
 
+		if( tr )
+			ts = _el_trace_now();
 		if( EL_READABLE & mask & fe->mask )
 			fe->rfile_proc(el,fd,fe->data,mask);
 		if( EL_WRITABLE & mask & fe->mask )
-			fe->wfile_proc(el,fd,fe->data,mask);
+			fe->wfile_proc(el,fd,fe->wdata,mask);
+		if( tr )
+			_el_trace_add(tr,EL_TRACE_FILE,fd,mask,ts,_el_trace_now()-ts);
 	}
-	return processed += _el_time_process(el);
+	processed += _el_time_process(el);
+
+	/* A slow iteration dumps the events leading up to it. */
+	if( tr && tr->slow && EL_INV != tr->fd && _el_trace_now() - start > tr->slow )
+		el_trace_dump(el,tr->fd);
+	return processed;
 }
 
 /* -------------------------------- api implementation ----------------------- */
@@ -292,7 +598,10 @@ err:
 }
 
 void el_destroy(elHandle *el) {
+	_el_work_destroy(el);
+	_el_trace_destroy(el);
 	_el_epoll_destroy(el);
+	_el_wait_clear(el);
 	_el_time_clear(el);
 	_el_file_clear(el);
 	EL_FREE(el->trigs);
@@ -311,7 +620,14 @@ int el_file_add(elHandle *el, int fd, int mask,
 		el->files[fd].wfile_proc = file_proc;
 	if( EL_FREEABLE & mask )
 		el->files[fd].free_proc = free_proc;
-	el->files[fd].data = data;
+	/* The write side keeps its own data, so arming EL_WRITABLE on an fd
+	 * does not take over the data its read and free procs were given. */
+	if( EL_WRITABLE & mask )
+		el->files[fd].wdata = data;
+	if( (EL_READABLE|EL_FREEABLE) & mask || EL_NONE == el->files[fd].mask )
+		el->files[fd].data = data;
+	if( el->trace )
+		_el_trace_add(el->trace,EL_TRACE_ADD,fd,mask,_el_trace_now(),0);
 	return _el_epoll_add(el,fd,mask);
 }
 
@@ -320,6 +636,8 @@ void el_file_del(elHandle *el, int fd, int mask) {
 	if( el->size <= fd )
 		return;
 	fmask = el->files[fd].mask;
+	if( el->trace )
+		_el_trace_add(el->trace,EL_TRACE_DEL,fd,mask,_el_trace_now(),0);
 	_el_epoll_del(el,fd,mask);
 	if( EL_FREEABLE & mask & fmask ) {
 		el->files[fd].free_proc(el,el->files[fd].data);
@@ -382,6 +700,222 @@ void el_time_del(elHandle *el, long id) {
 	}
 }
 
+long el_wait_add(elHandle *el,
+		el_wait_proc wait_proc, void *data,
+		el_free_proc free_proc) {
+	elWaitEvent *we = calloc(1,sizeof(*we));
+	if( !we )
+		return EL_ERR;
+
+	el->num++;
+	if( 0 > el->num )
+		el->num = 1;
+
+	we->id = el->num;
+	we->wait_proc = wait_proc;
+	we->free_proc = free_proc;
+	we->data = data;
+
+	we->prev = NULL;
+	we->next = el->waits;
+	if( el->waits )
+		el->waits->prev = we;
+	el->waits = we;
+	return we->id;
+}
+
+void el_wait_del(elHandle *el, long id) {
+	elWaitEvent *we = el->waits;
+	while( we ) {
+		if( we->id == id ) {
+			if( we->prev )
+				we->prev->next = we->next;
+			else
+				el->waits = we->next;
+			if( we->next )
+				we->next->prev = we->prev;
+			if( we->free_proc )
+				we->free_proc(el,we->data);
+			EL_FREE(we);
+			return;
+		}
+		we = we->next;
+	}
+}
+
+int el_work_create(elHandle *el, int threads, int depth) {
+	elWorks *ws;
+	int i;
+
+	if( el->works )
+		return EL_ERR;
+	if( 0 >= threads )
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if( 0 >= threads )
+		threads = 1;
+	if( 0 >= depth )
+		depth = threads * 64;
+
+	ws = calloc(1,sizeof(*ws));
+	if( !ws )
+		return EL_ERR;
+	ws->fd = EL_INV;
+	ws->depth = depth;
+	pthread_mutex_init(&ws->lock,NULL);
+	pthread_cond_init(&ws->cond,NULL);
+	ws->workers = calloc(threads,sizeof(*ws->workers));
+	if( !ws->workers )
+		goto err;
+	ws->fd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	if( EL_INV == ws->fd )
+		goto err;
+	if( EL_ERR == el_file_add(el,ws->fd,EL_READABLE,_el_work_deliver,ws,NULL) )
+		goto err;
+	el->works = ws;
+
+	for( ; threads > ws->threads; ws->threads++ ) {
+		elWorker *wk = &ws->workers[ws->threads];
+		wk->works = ws;
+		wk->ring = calloc(depth,sizeof(*wk->ring));
+		if( !wk->ring )
+			break;
+		pthread_mutex_init(&wk->lock,NULL);
+		if( pthread_create(&wk->tid,NULL,_el_work_thread,wk) ) {
+			pthread_mutex_destroy(&wk->lock);
+			EL_FREE(wk->ring);
+			break;
+		}
+	}
+	ws->stats.threads = ws->threads;
+	if( ws->threads )
+		return EL_OK;
+	_el_work_destroy(el);
+	return EL_ERR;
+err:
+	EL_CLOSE(ws->fd);
+	for( i = 0; ws->threads > i; ++i )
+		EL_FREE(ws->workers[i].ring);
+	pthread_cond_destroy(&ws->cond);
+	pthread_mutex_destroy(&ws->lock);
+	EL_FREE(ws->workers);
+	EL_FREE(ws);
+	return EL_ERR;
+}
+
+int el_queue_work(elHandle *el,
+		el_work_proc work_proc, el_done_proc done_proc,
+		void *data) {
+	elWorks *ws = el->works;
+	elWorker *wk;
+	elWork *w;
+
+	if( !ws )
+		return EL_ERR;
+
+	pthread_mutex_lock(&ws->lock);
+	if( ws->depth <= ws->stats.depth ) {
+		ws->stats.rejected++;
+		pthread_mutex_unlock(&ws->lock);
+		return EL_ERR;
+	}
+	ws->stats.depth++;
+	pthread_mutex_unlock(&ws->lock);
+
+	w = calloc(1,sizeof(*w));
+	if( !w ) {
+		pthread_mutex_lock(&ws->lock);
+		ws->stats.depth--;
+		ws->stats.rejected++;
+		pthread_mutex_unlock(&ws->lock);
+		return EL_ERR;
+	}
+	w->work_proc = work_proc;
+	w->done_proc = done_proc;
+	w->data = data;
+	w->queued = _el_work_now();
+
+	wk = &ws->workers[ws->next];
+	ws->next = (ws->next + 1) % ws->threads;
+	pthread_mutex_lock(&wk->lock);
+	wk->ring[(wk->head + wk->num) % ws->depth] = w;
+	wk->num++;
+	pthread_mutex_unlock(&wk->lock);
+
+	pthread_mutex_lock(&ws->lock);
+	ws->queued++;
+	ws->stats.submitted++;
+	if( ws->stats.depth > ws->stats.max_depth )
+		ws->stats.max_depth = ws->stats.depth;
+	pthread_cond_signal(&ws->cond);
+	pthread_mutex_unlock(&ws->lock);
+	return EL_OK;
+}
+
+void el_work_stats(elHandle *el, elWorkStats *stats) {
+	elWorks *ws = el->works;
+
+	memset(stats,0,sizeof(*stats));
+	if( !ws )
+		return;
+	pthread_mutex_lock(&ws->lock);
+	*stats = ws->stats;
+	pthread_mutex_unlock(&ws->lock);
+}
+
+/* Starts recording loop events into a ring of size records (rounded up to
+ * a power of two). With slow_us > 0, any iteration whose dispatch and
+ * timers take longer than that is followed by a dump to fd. */
+int el_trace_create(elHandle *el, int size, long slow_us, int fd) {
+	elTrace *tr;
+	unsigned long n = 1;
+
+	if( el->trace || 0 >= size )
+		return EL_ERR;
+	while( n < (unsigned long)size )
+		n <<= 1;
+	tr = calloc(1,sizeof(*tr));
+	if( !tr )
+		return EL_ERR;
+	tr->records = calloc(n,sizeof(*tr->records));
+	if( !tr->records ) {
+		EL_FREE(tr);
+		return EL_ERR;
+	}
+	tr->mask = n - 1;
+	tr->slow = 0 < slow_us ? slow_us * 1000LL : 0;
+	tr->fd = fd;
+	el->trace = tr;
+	return EL_OK;
+}
+
+/* Writes the records added since the previous dump, at most one ring's
+ * worth, and returns how many were written. Must be called on the loop
+ * thread, the ring is overwritten in place while the loop runs. */
+int el_trace_dump(elHandle *el, int fd) {
+	elTrace *tr = el->trace;
+	elTraceHeader hdr;
+	unsigned long head, from, i, n;
+
+	if( !tr )
+		return EL_ERR;
+	head = tr->head;
+	from = head - tr->dumped > tr->mask + 1 ? head - tr->mask - 1 : tr->dumped;
+
+	memcpy(hdr.magic,EL_TRACE_MAGIC,sizeof(hdr.magic));
+	hdr.count = head - from;
+	if( EL_OK != _el_trace_write(fd,&hdr,sizeof(hdr)) )
+		return EL_ERR;
+	for( i = from; head > i; i += n ) {
+		unsigned long at = i & tr->mask;
+
+		n = head - i < tr->mask + 1 - at ? head - i : tr->mask + 1 - at;
+		if( EL_OK != _el_trace_write(fd,&tr->records[at],n * sizeof(*tr->records)) )
+			return EL_ERR;
+	}
+	tr->dumped = head;
+	return (int)(head - from);
+}
+
 void el_main(elHandle *el) {
 	while( !el->stop )
 		_el_process(el);
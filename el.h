@@ -17,19 +17,25 @@ struct elHandle;
 typedef void (*el_file_proc)(struct elHandle *el, int fd, void *data, int mask);
 typedef void (*el_time_proc)(struct elHandle *el, long id, void *data);
 typedef void (*el_free_proc)(struct elHandle *el, void *data);
+typedef int (*el_wait_proc)(struct elHandle *el, long id, void *data);
+typedef void (*el_work_proc)(void *data);
+typedef void (*el_done_proc)(struct elHandle *el, void *data);
 
+/* data is passed to rfile_proc and free_proc, wdata to wfile_proc. */
 typedef struct elFileEvent {
 	int mask;
 	el_file_proc rfile_proc;
 	el_file_proc wfile_proc;
 	el_free_proc free_proc;
 	void *data;
+	void *wdata;
 } elFileEvent;
 
 typedef struct elTimeEvent {
 	long sc;
 	long ms;
 	long id;
+	int due;
 	el_time_proc time_proc;
 	el_free_proc free_proc;
 	void *data;
@@ -37,11 +43,51 @@ typedef struct elTimeEvent {
 	struct elTimeEvent *next;
 } elTimeEvent;
 
+typedef struct elWaitEvent {
+	long id;
+	el_wait_proc wait_proc;
+	el_free_proc free_proc;
+	void *data;
+	struct elWaitEvent *prev;
+	struct elWaitEvent *next;
+} elWaitEvent;
+
 typedef struct elTrigEvent {
     int fd;
     int mask;
 } elTrigEvent;
 
+typedef struct elWorkStats {
+	long threads;
+	long depth;
+	long max_depth;
+	long submitted;
+	long rejected;
+	long completed;
+	long wait_us;
+	long max_wait_us;
+	long run_us;
+	long max_run_us;
+} elWorkStats;
+
+/* One fixed-size trace record. ts is CLOCK_MONOTONIC in nanoseconds, dur
+ * the callback's run time for EL_TRACE_FILE and EL_TRACE_TIME. id is the
+ * fd for file records, the timer id for EL_TRACE_TIME, the timeout in ms
+ * for EL_TRACE_ENTER and the ready count for EL_TRACE_EXIT. */
+typedef struct elTraceRecord {
+	long long ts;
+	long long id;
+	int dur;
+	short type;
+	short mask;
+} elTraceRecord;
+
+/* Every dump starts with this header, followed by count records. */
+typedef struct elTraceHeader {
+	char magic[8];
+	long long count;
+} elTraceHeader;
+
 typedef struct elHandle {
 	int size;
 	int stop;
@@ -50,6 +96,9 @@ typedef struct elHandle {
 	elFileEvent *files;
 	elTrigEvent *trigs;
 	elTimeEvent *times;
+	elWaitEvent *waits;
+	void *works;
+	void *trace;
 	void *data;
 } elHandle;
 
@@ -64,10 +113,22 @@ typedef struct elHandle {
 #define EL_FREEABLE 4
 #define EL_ALLABLE (EL_READABLE|EL_WRITABLE|EL_FREEABLE)
 
+#define EL_TRACE_MAGIC "ELTRACE1"
+#define EL_TRACE_ENTER 1
+#define EL_TRACE_EXIT 2
+#define EL_TRACE_FILE 3
+#define EL_TRACE_TIME 4
+#define EL_TRACE_ADD 5
+#define EL_TRACE_DEL 6
+
 /* -------------------------------- api functions ---------------------------- */
 
 elHandle *el_create(int size, long ms);
 void el_destroy(elHandle *el);
+/* Adding EL_WRITABLE sets the data wfile_proc receives, adding EL_READABLE
+ * or EL_FREEABLE the data rfile_proc and free_proc receive, and the first
+ * add on an idle fd sets both. Each side then keeps its own pointer:
+ * re-adding EL_READABLE alone leaves wfile_proc with its earlier data. */
 int el_file_add(elHandle *el, int fd, int mask,
 		el_file_proc file_proc, void *data,
 		el_free_proc free_proc);
@@ -77,6 +138,17 @@ long el_time_add(elHandle *el, long ms,
 		el_time_proc time_proc, void *data,
 		el_free_proc free_proc);
 void el_time_del(elHandle *el, long id);
+long el_wait_add(elHandle *el,
+		el_wait_proc wait_proc, void *data,
+		el_free_proc free_proc);
+void el_wait_del(elHandle *el, long id);
+int el_work_create(elHandle *el, int threads, int depth);
+int el_queue_work(elHandle *el,
+		el_work_proc work_proc, el_done_proc done_proc,
+		void *data);
+void el_work_stats(elHandle *el, elWorkStats *stats);
+int el_trace_create(elHandle *el, int size, long slow_us, int fd);
+int el_trace_dump(elHandle *el, int fd);
 void el_main(elHandle *el);
 
 #ifdef __cplusplus
@@ -0,0 +1,675 @@
+/* HTTP/1.1 Server Implementation.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "el.h"
+#include "nio.h"
+#include "http.h"
+
+/* -------------------------------- struct ----------------------------------- */
+
+typedef struct httpConn {
+	int open;
+	int len;
+	int cap;
+	int closing;
+	long deadline;
+	char *buf;
+} httpConn;
+
+/* -------------------------------- define ----------------------------------- */
+
+#define HTTP_ERR_LEN 256
+#define HTTP_BUF_SIZE 16384
+#define HTTP_LINE_SIZE 1024
+
+#define HTTP_INCOMPLETE 0
+
+#define HTTP_FREE(_p) \
+	do { if(_p) { free(_p); _p = NULL; } } while(0)
+
+/* -------------------------------- private ---------------------------------- */
+
+static const char *_http_scan(const char *p, const char *end, char a, char b);
+static int _http_equal(httpStr *s, const char *str);
+static int _http_has_token(httpStr *s, const char *token);
+static int _http_coding(httpStr *s, int *chunked);
+static int _http_length(httpStr *s, long *length);
+static int _http_dechunk(char *buf, char *end, int move, int *len);
+static int _http_parse(httpRequest *req, char *buf, int len);
+static const char *_http_status(int status);
+static int _http_write(httpHandle *hh, int fd, const char *buf, int len);
+
+static long _http_now(void);
+static void _http_close(httpHandle *hh, int fd);
+static void _http_closing(httpHandle *hh, int fd);
+static void _http_error(httpHandle *hh, int fd, int status);
+static void _http_process(httpHandle *hh, int fd, httpConn *c);
+static void _http_read(elHandle *el, int fd, void *data, int mask);
+static void _http_accept(elHandle *el, int fd, void *data, int mask);
+static void _http_sweep(httpHandle *hh);
+static int _http_wait(elHandle *el, long id, void *data);
+static void _http_timer(elHandle *el, long id, void *data);
+
+/* -------------------------------- private implementation ------------------- */
+
+/* Returns the first byte in [p, end) equal to a or b, or end. Scans sixteen
+ * bytes per step where SSE2 is available. */
+static const char *_http_scan(const char *p, const char *end, char a, char b) {
+#if defined(__SSE2__)
+	__m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+
+	while( 16 <= end - p ) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v,va),_mm_cmpeq_epi8(v,vb)));
+		if( m )
+			return p + __builtin_ctz(m);
+		p += 16;
+	}
+#endif
+	while( end > p && a != *p && b != *p )
+		++p;
+	return p;
+}
+
+static int _http_equal(httpStr *s, const char *str) {
+	return (int)strlen(str) == s->len && !strncasecmp(s->p,str,s->len);
+}
+
+static int _http_has_token(httpStr *s, const char *token) {
+	int len = strlen(token), i;
+
+	for( i = 0; s->len - len >= i; ++i ) {
+		if( !strncasecmp(s->p+i,token,len) &&
+			(!i || ',' == s->p[i-1] || ' ' == s->p[i-1]) &&
+			(s->len == i + len || ',' == s->p[i+len] || ' ' == s->p[i+len]) )
+			return 1;
+	}
+	return 0;
+}
+
+/* Walks the comma-separated codings of one Transfer-Encoding value. chunked
+ * carries over between headers and must be the final coding, so a coding
+ * seen after it is an error. */
+static int _http_coding(httpStr *s, int *chunked) {
+	const char *p = s->p, *end = s->p + s->len;
+
+	while( end > p ) {
+		httpStr t;
+
+		while( end > p && (',' == *p || ' ' == *p || '\t' == *p) )
+			++p;
+		if( end == p )
+			break;
+		t.p = p;
+		while( end > p && ',' != *p && ' ' != *p && '\t' != *p )
+			++p;
+		t.len = p - t.p;
+		if( *chunked )
+			return HTTP_ERR;
+		*chunked = _http_equal(&t,"chunked");
+	}
+	return HTTP_OK;
+}
+
+static int _http_length(httpStr *s, long *length) {
+	int i;
+
+	*length = 0;
+	if( !s->len )
+		return HTTP_ERR;
+	for( i = 0; s->len > i; ++i ) {
+		if( '0' > s->p[i] || '9' < s->p[i] )
+			return HTTP_ERR;
+		*length = *length * 10 + s->p[i] - '0';
+		if( HTTP_MAX_REQUEST < *length )
+			return HTTP_ERR;
+	}
+	return HTTP_OK;
+}
+
+/* Walks a chunked body starting at buf. With move set the chunk payloads are
+ * compacted to the front of buf. Returns the bytes the encoded body spans,
+ * HTTP_INCOMPLETE or HTTP_ERR, and the decoded length in *len. */
+static int _http_dechunk(char *buf, char *end, int move, int *len) {
+	char *p = buf, *dst = buf;
+	const char *q;
+
+	*len = 0;
+	while( 1 ) {
+		long size = 0;
+
+		q = _http_scan(p,end,'\r',';');
+		if( end == q )
+			return HTTP_INCOMPLETE;
+		if( q == p )
+			return HTTP_ERR;
+		for( ; q > p; ++p ) {
+			int d = *p;
+			if( '0' <= d && '9' >= d )
+				d -= '0';
+			else if( 'a' <= (d | 0x20) && 'f' >= (d | 0x20) )
+				d = (d | 0x20) - 'a' + 10;
+			else
+				return HTTP_ERR;
+			size = size * 16 + d;
+			if( HTTP_MAX_REQUEST < size )
+				return HTTP_ERR;
+		}
+		q = _http_scan(p,end,'\r','\r');
+		if( 2 > end - q )
+			return HTTP_INCOMPLETE;
+		if( '\n' != q[1] )
+			return HTTP_ERR;
+		p = (char *)q + 2;
+
+		if( !size )
+			break;
+		if( size + 2 > end - p )
+			return HTTP_INCOMPLETE;
+		if( '\r' != p[size] || '\n' != p[size+1] )
+			return HTTP_ERR;
+		if( move )
+			memmove(dst,p,size);
+		dst += size;
+		*len += size;
+		if( HTTP_MAX_REQUEST < *len )
+			return HTTP_ERR;
+		p += size + 2;
+	}
+
+	while( 1 ) {
+		q = _http_scan(p,end,'\r','\r');
+		if( 2 > end - q )
+			return HTTP_INCOMPLETE;
+		if( '\n' != q[1] )
+			return HTTP_ERR;
+		if( q == p )
+			return q + 2 - buf;
+		p = (char *)q + 2;
+	}
+}
+
+/* Parses one request in place. All views in req point into buf. Returns the
+ * bytes the request spans, HTTP_INCOMPLETE or HTTP_ERR. */
+static int _http_parse(httpRequest *req, char *buf, int len) {
+	char *p = buf, *end = buf + len;
+	const char *q;
+	httpStr *s;
+	int hl, i, te = 0, cl = 0;
+
+	memset(req,0,offsetof(httpRequest,headers));
+
+	while( end > p && ('\r' == *p || '\n' == *p) )
+		++p;
+
+	q = _http_scan(p,end,' ','\r');
+	if( end == q )
+		return HTTP_INCOMPLETE;
+	if( ' ' != *q || q == p )
+		return HTTP_ERR;
+	req->method.p = p;
+	req->method.len = q - p;
+	p = (char *)q + 1;
+
+	q = _http_scan(p,end,' ','\r');
+	if( end == q )
+		return HTTP_INCOMPLETE;
+	if( ' ' != *q || q == p )
+		return HTTP_ERR;
+	req->path.p = p;
+	req->path.len = q - p;
+	p = (char *)q + 1;
+
+	if( 10 > end - p )
+		return HTTP_INCOMPLETE;
+	if( memcmp(p,"HTTP/1.",7) || '0' > p[7] || '9' < p[7] || '\r' != p[8] || '\n' != p[9] )
+		return HTTP_ERR;
+	req->minor = p[7] - '0';
+	req->keepalive = 0 < req->minor;
+	p += 10;
+
+	while( 1 ) {
+		httpHeader *h;
+
+		if( end == p )
+			return HTTP_INCOMPLETE;
+		if( '\r' == *p ) {
+			if( 2 > end - p )
+				return HTTP_INCOMPLETE;
+			if( '\n' != p[1] )
+				return HTTP_ERR;
+			p += 2;
+			break;
+		}
+		if( HTTP_MAX_HEADERS == req->nheader )
+			return HTTP_ERR;
+		h = &req->headers[req->nheader];
+
+		q = _http_scan(p,end,':','\r');
+		if( end == q )
+			return HTTP_INCOMPLETE;
+		if( ':' != *q || q == p )
+			return HTTP_ERR;
+		h->name.p = p;
+		h->name.len = q - p;
+		p = (char *)q + 1;
+		while( end > p && (' ' == *p || '\t' == *p) )
+			++p;
+
+		q = _http_scan(p,end,'\r','\n');
+		if( 2 > end - q )
+			return HTTP_INCOMPLETE;
+		if( '\r' != *q || '\n' != q[1] )
+			return HTTP_ERR;
+		h->value.p = p;
+		h->value.len = q - p;
+		while( h->value.len && (' ' == p[h->value.len-1] || '\t' == p[h->value.len-1]) )
+			h->value.len--;
+		p = (char *)q + 2;
+		req->nheader++;
+	}
+	hl = p - buf;
+
+	if( (s = http_header(req,"Connection")) ) {
+		if( _http_has_token(s,"close") )
+			req->keepalive = 0;
+		else if( _http_has_token(s,"keep-alive") )
+			req->keepalive = 1;
+	}
+	/* Framing is where request smuggling hides: Content-Length headers that
+	 * disagree, Transfer-Encoding next to Content-Length, or chunked not
+	 * being the final coding all get the request rejected. */
+	for( i = 0; req->nheader > i; ++i ) {
+		httpHeader *h = &req->headers[i];
+
+		if( _http_equal(&h->name,"Transfer-Encoding") ) {
+			te = 1;
+			if( HTTP_OK != _http_coding(&h->value,&req->chunked) )
+				return HTTP_ERR;
+		} else if( _http_equal(&h->name,"Content-Length") ) {
+			long length;
+			if( HTTP_OK != _http_length(&h->value,&length) || (cl && length != req->length) )
+				return HTTP_ERR;
+			req->length = length;
+			cl = 1;
+		}
+	}
+	if( te && (!req->chunked || cl) )
+		return HTTP_ERR;
+
+	req->body.p = p;
+	if( req->chunked ) {
+		int r = _http_dechunk(p,end,0,&req->body.len);
+		if( 0 >= r )
+			return r;
+		_http_dechunk(p,end,1,&req->body.len);
+		req->length = req->body.len;
+		return hl + r;
+	}
+	if( req->length > end - p )
+		return HTTP_INCOMPLETE;
+	req->body.len = req->length;
+	return hl + req->length;
+}
+
+static const char *_http_status(int status) {
+	switch( status ) {
+	case 100: return "Continue";
+	case 200: return "OK";
+	case 201: return "Created";
+	case 204: return "No Content";
+	case 301: return "Moved Permanently";
+	case 302: return "Found";
+	case 304: return "Not Modified";
+	case 400: return "Bad Request";
+	case 401: return "Unauthorized";
+	case 403: return "Forbidden";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 413: return "Payload Too Large";
+	case 500: return "Internal Server Error";
+	case 503: return "Service Unavailable";
+	default: return "Unknown";
+	}
+}
+
+static int _http_write(httpHandle *hh, int fd, const char *buf, int len) {
+	if( NIO_OK != nio_tcp_coalesce_write(NULL,hh->nc,fd,(char *)buf,len) )
+		return HTTP_ERR;
+	return HTTP_OK;
+}
+
+static long _http_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void _http_close(httpHandle *hh, int fd) {
+	httpConn *c = (httpConn *)hh->conns + fd;
+
+	nio_coalesce_clear(hh->nc,fd);
+	el_file_del(hh->el,fd,EL_ALLABLE);
+	nio_close(fd);
+	HTTP_FREE(c->buf);
+	memset(c,0,sizeof(*c));
+}
+
+/* Stops reading from fd and closes it once its queued output is flushed,
+ * or after HTTP_CLOSE_TIMEOUT ms if the peer never takes it. */
+static void _http_closing(httpHandle *hh, int fd) {
+	httpConn *c = (httpConn *)hh->conns + fd;
+
+	if( c->closing )
+		return;
+	c->closing = 1;
+	c->deadline = _http_now() + HTTP_CLOSE_TIMEOUT;
+	el_file_del(hh->el,fd,EL_READABLE);
+	hh->closes[hh->nclose++] = fd;
+	if( EL_ERR == hh->timer )
+		hh->timer = el_time_add(hh->el,HTTP_CLOSE_TIMEOUT,_http_timer,hh,NULL);
+}
+
+static void _http_error(httpHandle *hh, int fd, int status) {
+	httpRequest req;
+
+	memset(&req,0,offsetof(httpRequest,headers));
+	req.fd = fd;
+	req.minor = 1;
+	http_response(hh,&req,status,NULL,NULL,0);
+	_http_closing(hh,fd);
+}
+
+static void _http_process(httpHandle *hh, int fd, httpConn *c) {
+	httpRequest req;
+	int off = 0, r;
+
+	while( !c->closing && c->len > off ) {
+		r = _http_parse(&req,c->buf+off,c->len-off);
+		if( HTTP_INCOMPLETE == r ) {
+			if( !off && c->len >= HTTP_MAX_REQUEST )
+				_http_error(hh,fd,413);
+			break;
+		}
+		if( HTTP_ERR == r ) {
+			_http_error(hh,fd,400);
+			break;
+		}
+		req.fd = fd;
+		hh->requests++;
+		hh->request_proc(hh,&req,hh->data);
+		if( !req.keepalive )
+			_http_closing(hh,fd);
+		off += r;
+	}
+
+	c->len -= off;
+	if( c->len && off )
+		memmove(c->buf,c->buf+off,c->len);
+	if( !c->len ) {
+		HTTP_FREE(c->buf);
+		c->cap = 0;
+	}
+}
+
+static void _http_read(elHandle *el, int fd, void *data, int mask) {
+	httpHandle *hh = data;
+	httpConn *c = (httpConn *)hh->conns + fd;
+	int byte, eof = 0;
+	((void)el);
+	((void)mask);
+
+	while( 1 ) {
+		if( c->len == c->cap ) {
+			int cap = c->cap ? c->cap * 2 : HTTP_BUF_SIZE;
+			char *buf;
+
+			if( HTTP_MAX_REQUEST < cap )
+				break;
+			if( !(buf = realloc(c->buf,cap)) ) {
+				_http_close(hh,fd);
+				return;
+			}
+			c->buf = buf;
+			c->cap = cap;
+		}
+		byte = read(fd,c->buf+c->len,c->cap-c->len);
+		if( 0 < byte ) {
+			c->len += byte;
+			continue;
+		}
+		if( NIO_ERR == byte && EINTR == errno )
+			continue;
+		if( NIO_ERR == byte && EAGAIN == errno )
+			break;
+		if( !byte ) {
+			eof = 1;
+			break;
+		}
+		_http_close(hh,fd);
+		return;
+	}
+	_http_process(hh,fd,c);
+	/* A peer that half-closes after its last request still gets the
+	 * responses, the connection closes once they drain. */
+	if( eof )
+		_http_closing(hh,fd);
+}
+
+static void _http_accept(elHandle *el, int fd, void *data, int mask) {
+	httpHandle *hh = data;
+	int c;
+	((void)mask);
+
+	while( NIO_ERR != (c = nio_tcp_accept(NULL,fd,NULL,0,NULL)) ) {
+		if( hh->size <= c ) {
+			nio_close(c);
+			continue;
+		}
+		nio_enable_tcp_nonblock(NULL,c);
+		nio_enable_tcp_nodelay(NULL,c);
+		nio_disable_tcp_linger(NULL,c);
+		if( EL_ERR == el_file_add(el,c,EL_READABLE,_http_read,hh,NULL) )
+			nio_close(c);
+		else
+			((httpConn *)hh->conns + c)->open = 1;
+	}
+}
+
+/* Closes the closing connections whose output has drained or whose
+ * deadline has passed. Output still queued is flushed by the coalescer on
+ * EL_WRITABLE, so nothing here keeps the loop from sleeping. */
+static void _http_sweep(httpHandle *hh) {
+	long now = 0;
+	int i, n = 0;
+
+	for( i = 0; hh->nclose > i; ++i ) {
+		int fd = hh->closes[i];
+
+		if( nio_coalesce_pending(hh->nc,fd) ) {
+			if( !now )
+				now = _http_now();
+			if( ((httpConn *)hh->conns + fd)->deadline > now ) {
+				hh->closes[n++] = fd;
+				continue;
+			}
+		}
+		_http_close(hh,fd);
+	}
+	hh->nclose = n;
+}
+
+static int _http_wait(elHandle *el, long id, void *data) {
+	((void)el);
+	((void)id);
+	_http_sweep(data);
+	return 0;
+}
+
+static void _http_timer(elHandle *el, long id, void *data) {
+	httpHandle *hh = data;
+	((void)id);
+
+	hh->timer = EL_ERR;
+	_http_sweep(hh);
+	if( hh->nclose )
+		hh->timer = el_time_add(el,HTTP_CLOSE_TIMEOUT / 4,_http_timer,hh,NULL);
+}
+
+/* -------------------------------- api implementation ----------------------- */
+
+httpHandle *http_server(char *err, elHandle *el, const char *addr, int port,
+		http_request_proc request_proc, void *data) {
+	httpHandle *hh = calloc(1,sizeof(*hh));
+
+	if( !hh ) {
+		if( err )
+			snprintf(err,HTTP_ERR_LEN-1,"http: out of memory");
+		return NULL;
+	}
+	hh->fd = NIO_INV;
+	hh->id = EL_ERR;
+	hh->timer = EL_ERR;
+	hh->el = el;
+	hh->size = el->size;
+	hh->request_proc = request_proc;
+	hh->data = data;
+
+	hh->conns = calloc(hh->size,sizeof(httpConn));
+	hh->closes = calloc(hh->size,sizeof(*hh->closes));
+	if( !hh->conns || !hh->closes || !(hh->nc = nio_coalesce_create(el)) ) {
+		if( err )
+			snprintf(err,HTTP_ERR_LEN-1,"http: out of memory");
+		goto err;
+	}
+	if( EL_ERR == (hh->id = el_wait_add(el,_http_wait,hh,NULL)) ) {
+		if( err )
+			snprintf(err,HTTP_ERR_LEN-1,"http: out of memory");
+		goto err;
+	}
+	if( NIO_ERR == (hh->fd = nio_tcp_server(err,addr,port,1024)) )
+		goto err;
+	if( NIO_ERR == nio_enable_tcp_nonblock(err,hh->fd) )
+		goto err;
+	if( EL_ERR == el_file_add(el,hh->fd,EL_READABLE,_http_accept,hh,NULL) ) {
+		if( err )
+			snprintf(err,HTTP_ERR_LEN-1,"http: fd %d out of range",hh->fd);
+		goto err;
+	}
+	return hh;
+err:
+	http_destroy(hh);
+	return NULL;
+}
+
+void http_destroy(httpHandle *hh) {
+	int fd;
+
+	if( NIO_INV != hh->fd ) {
+		el_file_del(hh->el,hh->fd,EL_ALLABLE);
+		nio_close(hh->fd);
+	}
+	if( hh->conns && hh->nc ) {
+		for( fd = 0; hh->size > fd; ++fd ) {
+			if( ((httpConn *)hh->conns + fd)->open )
+				_http_close(hh,fd);
+		}
+	}
+	if( EL_ERR != hh->timer )
+		el_time_del(hh->el,hh->timer);
+	if( EL_ERR != hh->id )
+		el_wait_del(hh->el,hh->id);
+	if( hh->nc )
+		nio_coalesce_destroy(hh->nc);
+	HTTP_FREE(hh->closes);
+	HTTP_FREE(hh->conns);
+	HTTP_FREE(hh);
+}
+
+httpStr *http_header(httpRequest *req, const char *name) {
+	int i;
+	for( i = 0; req->nheader > i; ++i ) {
+		if( _http_equal(&req->headers[i].name,name) )
+			return &req->headers[i].value;
+	}
+	return NULL;
+}
+
+/* Queues a complete response. Responses to pipelined requests land in the
+ * loop's coalescer and leave in one write before the loop sleeps. */
+int http_response(httpHandle *hh, httpRequest *req, int status,
+		const char *headers, const char *body, int len) {
+	char line[HTTP_LINE_SIZE];
+	int n;
+
+	n = snprintf(line,sizeof(line),"HTTP/1.1 %d %s\r\nContent-Length: %d\r\n%s%s\r\n",
+		status,_http_status(status),len,
+		!req->keepalive ? "Connection: close\r\n" :
+			(!req->minor ? "Connection: keep-alive\r\n" : ""),
+		headers ? headers : "");
+	if( 0 > n || (int)sizeof(line) <= n )
+		return HTTP_ERR;
+	if( HTTP_ERR == _http_write(hh,req->fd,line,n) )
+		return HTTP_ERR;
+	if( len && HTTP_ERR == _http_write(hh,req->fd,body,len) )
+		return HTTP_ERR;
+	return HTTP_OK;
+}
+
+/* HTTP/1.0 peers can't take chunked encoding, so their body is sent raw and
+ * delimited by closing the connection instead. */
+int http_chunked_begin(httpHandle *hh, httpRequest *req, int status, const char *headers) {
+	char line[HTTP_LINE_SIZE];
+	int n;
+
+	req->reply_chunked = 0 < req->minor;
+	if( !req->reply_chunked )
+		req->keepalive = 0;
+	n = snprintf(line,sizeof(line),"HTTP/1.1 %d %s\r\n%s%s%s\r\n",
+		status,_http_status(status),
+		req->reply_chunked ? "Transfer-Encoding: chunked\r\n" : "",
+		!req->keepalive ? "Connection: close\r\n" : "",
+		headers ? headers : "");
+	if( 0 > n || (int)sizeof(line) <= n )
+		return HTTP_ERR;
+	return _http_write(hh,req->fd,line,n);
+}
+
+int http_chunked_write(httpHandle *hh, httpRequest *req, const char *buf, int len) {
+	char size[16];
+	int n;
+
+	if( !len )
+		return HTTP_OK;
+	if( req->reply_chunked ) {
+		n = snprintf(size,sizeof(size),"%x\r\n",len);
+		if( HTTP_ERR == _http_write(hh,req->fd,size,n) )
+			return HTTP_ERR;
+	}
+	if( HTTP_ERR == _http_write(hh,req->fd,buf,len) )
+		return HTTP_ERR;
+	if( req->reply_chunked )
+		return _http_write(hh,req->fd,"\r\n",2);
+	return HTTP_OK;
+}
+
+int http_chunked_end(httpHandle *hh, httpRequest *req) {
+	if( !req->reply_chunked )
+		return HTTP_OK;
+	return _http_write(hh,req->fd,"0\r\n\r\n",5);
+}
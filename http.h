@@ -0,0 +1,85 @@
+/* HTTP/1.1 Server Implementation.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ */
+
+#ifndef __HTTP_H_
+#define __HTTP_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* -------------------------------- define ----------------------------------- */
+
+#define HTTP_OK 0
+#define HTTP_ERR -1
+
+#define HTTP_MAX_HEADERS 64
+#define HTTP_MAX_REQUEST (1024 * 1024)
+#define HTTP_CLOSE_TIMEOUT 5000
+
+/* -------------------------------- struct ----------------------------------- */
+
+struct elHandle;
+struct nioCoalesce;
+struct httpHandle;
+
+typedef struct httpStr {
+	const char *p;
+	int len;
+} httpStr;
+
+typedef struct httpHeader {
+	httpStr name;
+	httpStr value;
+} httpHeader;
+
+typedef struct httpRequest {
+	int fd;
+	int minor;
+	int keepalive;
+	int chunked;
+	int reply_chunked;
+	long length;
+	httpStr method;
+	httpStr path;
+	httpStr body;
+	int nheader;
+	httpHeader headers[HTTP_MAX_HEADERS];
+} httpRequest;
+
+typedef void (*http_request_proc)(struct httpHandle *hh, httpRequest *req, void *data);
+
+typedef struct httpHandle {
+	int fd;
+	int size;
+	int nclose;
+	long id;
+	long timer;
+	long requests;
+	int *closes;
+	void *conns;
+	struct elHandle *el;
+	struct nioCoalesce *nc;
+	http_request_proc request_proc;
+	void *data;
+} httpHandle;
+
+/* -------------------------------- api functions ---------------------------- */
+
+httpHandle *http_server(char *err, struct elHandle *el, const char *addr, int port,
+		http_request_proc request_proc, void *data);
+void http_destroy(httpHandle *hh);
+httpStr *http_header(httpRequest *req, const char *name);
+int http_response(httpHandle *hh, httpRequest *req, int status,
+		const char *headers, const char *body, int len);
+int http_chunked_begin(httpHandle *hh, httpRequest *req, int status, const char *headers);
+int http_chunked_write(httpHandle *hh, httpRequest *req, const char *buf, int len);
+int http_chunked_end(httpHandle *hh, httpRequest *req);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HTTP_H_ */
@@ -3,6 +3,8 @@
  * This library is free software; you can redistribute it and/or modify
  */
 
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -10,20 +12,180 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "el.h"
 #include "nio.h"
 
+/* -------------------------------- struct ----------------------------------- */
+
+typedef struct nioChunk {
+	int off;
+	int len;
+	int cap;
+	char *buf;
+	nioBuffer *ref;
+} nioChunk;
+
+typedef struct nioOutput {
+	int error;
+	int dirty;
+	int blocked;
+	int num;
+	int cap;
+	nioChunk *chunks;
+} nioOutput;
+
+struct nioCoalesce {
+	elHandle *el;
+	long id;
+	int size;
+	int ndirty;
+	int *dirtys;
+	nioOutput *outputs;
+};
+
+/* The kernel's struct tcp_info ABI up to tcpi_min_rtt, spelled out rather
+ * than extending libc's struct tcp_info, whose length differs between libcs
+ * and releases. */
+typedef struct nioTcpInfo {
+	uint8_t state;
+	uint8_t ca_state;
+	uint8_t retransmits;
+	uint8_t probes;
+	uint8_t backoff;
+	uint8_t options;
+	uint8_t wscale;
+	uint8_t flags;
+	uint32_t rto;
+	uint32_t ato;
+	uint32_t snd_mss;
+	uint32_t rcv_mss;
+	uint32_t unacked;
+	uint32_t sacked;
+	uint32_t lost;
+	uint32_t retrans;
+	uint32_t fackets;
+	uint32_t last_data_sent;
+	uint32_t last_ack_sent;
+	uint32_t last_data_recv;
+	uint32_t last_ack_recv;
+	uint32_t pmtu;
+	uint32_t rcv_ssthresh;
+	uint32_t rtt;
+	uint32_t rttvar;
+	uint32_t snd_ssthresh;
+	uint32_t snd_cwnd;
+	uint32_t advmss;
+	uint32_t reordering;
+	uint32_t rcv_rtt;
+	uint32_t rcv_space;
+	uint32_t total_retrans;
+	uint64_t pacing_rate;
+	uint64_t max_pacing_rate;
+	uint64_t bytes_acked;
+	uint64_t bytes_received;
+	uint32_t segs_out;
+	uint32_t segs_in;
+	uint32_t notsent_bytes;
+	uint32_t min_rtt;
+} nioTcpInfo;
+
+_Static_assert(104 == offsetof(nioTcpInfo,pacing_rate) && 144 == offsetof(nioTcpInfo,notsent_bytes),
+	"nioTcpInfo does not match the kernel's struct tcp_info");
+
+struct nioSampler {
+	elHandle *el;
+	long id;
+	long ms;
+	int batch;
+	int top;
+	int cursor;
+	nioTcpStats work;
+	nioTcpStats stats;
+};
+
+typedef struct nioPartial {
+	int len;
+	char *buf;
+	nio_scratch_proc proc;
+	void *data;
+} nioPartial;
+
+struct nioScratch {
+	elHandle *el;
+	int size;
+	char *buf;
+	nioPartial *partials;
+};
+
+struct nioAcceptor {
+	elHandle *el;
+	int fd;
+	int reserve;
+	int high;
+	int low;
+	long id;
+	nio_accept_proc proc;
+	void *data;
+	nioAcceptStats stats;
+};
+
+typedef struct nioPipe {
+	int in;
+	int out;
+	int pipe[2];
+	int cap;
+	int pending;
+	int full;
+	int eof;
+} nioPipe;
+
+typedef struct nioRelay {
+	struct nioRelays *nr;
+	int a;
+	int b;
+	int mask[2];
+	nioPipe dirs[2];
+	nio_relay_proc done_proc;
+	void *data;
+	struct nioRelay *prev;
+	struct nioRelay *next;
+} nioRelay;
+
+struct nioRelays {
+	elHandle *el;
+	int max;
+	int num;
+	int (*pipes)[2];
+	nioRelay *relays;
+};
+
 /* -------------------------------- define ----------------------------------- */
 
 #define	NIO_ERR_LEN	256
 
+#define NIO_CHUNK_SIZE 4096
+#define NIO_IOV_MAX 64
+#define NIO_SAMPLER_SCAN 16
+#define NIO_SCRATCH_SIZE (256 * 1024)
+#define NIO_ACCEPT_BATCH 64
+#define NIO_ACCEPT_PAUSE 100
+#define NIO_RELAY_SPLICE (SPLICE_F_MOVE|SPLICE_F_NONBLOCK)
+
+#define NIO_FREE(_p) \
+	do { if(_p) { free(_p); _p = NULL; } } while(0)
+
 #define NIO_CONNECT_NONE 0
 #define NIO_CONNECT_NONBLOCK 1
+#define NIO_CONNECT_FASTOPEN 2
 
 /* -------------------------------- private ---------------------------------- */
 
@@ -36,10 +198,43 @@ static int _nio_enable_tcp_nodelay(char *err, int fd, int enable);
 static int _nio_enable_tcp_keepalive(char *err, int fd, int enable);
 
 static int _nio_tcp_listen(char *err, int fd, struct sockaddr *sa, socklen_t len, int backlog);
-static int _nio_tcp_generic_connect(char *err, const char *addr, int port, int flags);
+static int _nio_tcp_generic_connect(char *err, const char *addr, int port, int flags,
+		char *buf, int count, int *sent);
 static int _nio_tcp_generic_server(char *err, const char *addr, int port, int family, int backlog);
 static int _nio_tcp_generic_accept(char *err, int fd, struct sockaddr *sa, socklen_t *len);
 
+static void _nio_chunk_free(nioChunk *c);
+static nioChunk *_nio_output_chunk(nioOutput *o);
+static void _nio_output_drop(nioOutput *o);
+static int _nio_output_append(nioOutput *o, char *buf, int count);
+static int _nio_output_append_buffer(nioOutput *o, nioBuffer *nb);
+static nioOutput *_nio_coalesce_output(char *err, nioCoalesce *nc, int fd);
+static int _nio_output_flush(char *err, nioOutput *o, int fd);
+static int _nio_coalesce_wait(elHandle *el, long id, void *data);
+static void _nio_coalesce_writable(elHandle *el, int fd, void *data, int mask);
+static void _nio_coalesce_free(elHandle *el, void *data);
+
+static int _nio_sampler_bucket(unsigned int value);
+static void _nio_sampler_record(nioSampler *ns, nioTcpSample *sm);
+static void _nio_sampler_timer(elHandle *el, long id, void *data);
+
+static void _nio_scratch_read(elHandle *el, int fd, void *data, int mask);
+
+static void _nio_acceptor_pause(nioAcceptor *na, int reason);
+static void _nio_acceptor_resume(nioAcceptor *na);
+static void _nio_acceptor_shed(nioAcceptor *na);
+static void _nio_acceptor_timer(elHandle *el, long id, void *data);
+static void _nio_acceptor_read(elHandle *el, int fd, void *data, int mask);
+
+static int _nio_relays_get(nioRelays *nr, int *pipefd);
+static void _nio_relays_put(nioRelays *nr, nioPipe *p);
+static void _nio_relay_free(nioRelay *r);
+static int _nio_relay_pump(nioPipe *p);
+static void _nio_relay_arm(nioRelay *r);
+static void _nio_relay_run(nioRelay *r, nioPipe *p);
+static void _nio_relay_read(elHandle *el, int fd, void *data, int mask);
+static void _nio_relay_write(elHandle *el, int fd, void *data, int mask);
+
 /* -------------------------------- private implementation ------------------- */
 
 static void _nio_error(char *err, const char *fmt, ...) {
@@ -113,7 +308,8 @@ static int _nio_tcp_listen(char *err, int fd, struct sockaddr *sa, socklen_t len
 	return NIO_OK;
 }
 
-static int _nio_tcp_generic_connect(char *err, const char *addr, int port, int flags) {
+static int _nio_tcp_generic_connect(char *err, const char *addr, int port, int flags,
+		char *buf, int count, int *sent) {
 	struct addrinfo hints, *serinfo, *p;
 	char sport[6]; sport[0] = '\0';  /* strlen("65535") + 1; */
 	int c = -1, r;
@@ -135,10 +331,34 @@ static int _nio_tcp_generic_connect(char *err, const char *addr, int port, int f
 			goto err;
 		if( (NIO_CONNECT_NONBLOCK & flags) && NIO_ERR == nio_enable_tcp_nonblock(err,c) )
 			goto err;
+#if defined(MSG_FASTOPEN)
+		if( NIO_CONNECT_FASTOPEN & flags ) {
+			/* The SYN carries as much of buf as fits when the kernel has a
+			 * cookie for the peer; otherwise it requests one and nothing
+			 * is sent. EOPNOTSUPP means client TFO is off: connect plainly. */
+			r = sendto(c,buf,count,MSG_FASTOPEN|MSG_NOSIGNAL,p->ai_addr,p->ai_addrlen);
+			if( 0 <= r ) {
+				*sent = r;
+				goto end;
+			}
+			if( EINPROGRESS == errno )
+				goto end;
+			if( EOPNOTSUPP != errno ) {
+				nio_close(c);
+				c = NIO_ERR;
+				continue;
+			}
+		}
+#else
+		((void)buf);
+		((void)count);
+		((void)sent);
+#endif
 		if( NIO_ERR == connect(c,p->ai_addr,p->ai_addrlen) ) {
 			if( (NIO_CONNECT_NONBLOCK & flags) && EINPROGRESS == errno )
 				goto end;
 			nio_close(c);
+			c = NIO_ERR;
 			continue;
 		}
 		goto end;
@@ -209,14 +429,534 @@ static int _nio_tcp_generic_accept(char *err, int fd, struct sockaddr *sa, sockl
 	return c;
 }
 
+static void _nio_chunk_free(nioChunk *c) {
+	if( c->ref ) {
+		nio_buffer_release(c->ref);
+		c->ref = NULL;
+		c->buf = NULL;
+	} else {
+		NIO_FREE(c->buf);
+	}
+}
+
+/* Returns a fresh slot at the tail of the queue; the caller fills it in
+ * and bumps o->num. */
+static nioChunk *_nio_output_chunk(nioOutput *o) {
+	if( o->num == o->cap ) {
+		int cap = o->cap ? o->cap * 2 : 4;
+		nioChunk *chunks = realloc(o->chunks,cap*sizeof(*chunks));
+		if( !chunks )
+			return NULL;
+		o->chunks = chunks;
+		o->cap = cap;
+	}
+	return &o->chunks[o->num];
+}
+
+static void _nio_output_drop(nioOutput *o) {
+	int i;
+	for( i = 0; o->num > i; ++i )
+		_nio_chunk_free(&o->chunks[i]);
+	NIO_FREE(o->chunks);
+	o->num = o->cap = 0;
+}
+
+static int _nio_output_append(nioOutput *o, char *buf, int count) {
+	nioChunk *c = o->num ? &o->chunks[o->num-1] : NULL;
+
+	if( !c || count > c->cap - c->len ) {
+		if( !(c = _nio_output_chunk(o)) )
+			return NIO_ERR;
+		c->cap = NIO_CHUNK_SIZE > count ? NIO_CHUNK_SIZE : count;
+		c->off = c->len = 0;
+		c->ref = NULL;
+		if( !(c->buf = malloc(c->cap)) )
+			return NIO_ERR;
+		o->num++;
+	}
+	memcpy(c->buf+c->len,buf,count);
+	c->len += count;
+	return NIO_OK;
+}
+
+/* Queues a reference to nb rather than a copy. cap equals len so later
+ * appends never write into the shared buffer. */
+static int _nio_output_append_buffer(nioOutput *o, nioBuffer *nb) {
+	nioChunk *c;
+
+	if( !nb->len )
+		return NIO_OK;
+	if( !(c = _nio_output_chunk(o)) )
+		return NIO_ERR;
+	c->off = 0;
+	c->len = c->cap = nb->len;
+	c->buf = nb->data;
+	c->ref = nio_buffer_retain(nb);
+	o->num++;
+	return NIO_OK;
+}
+
+/* Writes as much of the queued output as the socket takes in one go and
+ * returns the number of chunks still queued, or NIO_ERR. */
+static int _nio_output_flush(char *err, nioOutput *o, int fd) {
+	struct iovec iov[NIO_IOV_MAX];
+	struct msghdr msg;
+	int byte, done, n;
+
+	while( o->num ) {
+		for( n = 0; o->num > n && NIO_IOV_MAX > n; ++n ) {
+			iov[n].iov_base = o->chunks[n].buf + o->chunks[n].off;
+			iov[n].iov_len = o->chunks[n].len - o->chunks[n].off;
+		}
+		memset(&msg,0,sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+
+		byte = sendmsg(fd,&msg,MSG_NOSIGNAL);
+		if( NIO_ERR == byte ) {
+			if( EINTR == errno )
+				continue;
+			if( EAGAIN == errno )
+				break;
+			_nio_error(err,"sendmsg: %s",strerror(errno));
+			o->error = errno;
+			_nio_output_drop(o);
+			return NIO_ERR;
+		}
+
+		for( done = 0; o->num > done; ++done ) {
+			nioChunk *c = &o->chunks[done];
+			if( byte < c->len - c->off ) {
+				c->off += byte;
+				break;
+			}
+			byte -= c->len - c->off;
+			_nio_chunk_free(c);
+		}
+		o->num -= done;
+		memmove(o->chunks,o->chunks+done,o->num*sizeof(*o->chunks));
+	}
+	if( !o->num )
+		_nio_output_drop(o);
+	return o->num;
+}
+
+/* Runs right before the loop blocks in epoll_wait. Output the kernel could
+ * not take is parked on EL_WRITABLE, so only output queued since the flush
+ * keeps the next wait non-blocking. */
+static int _nio_coalesce_wait(elHandle *el, long id, void *data) {
+	nioCoalesce *nc = data;
+	((void)el);
+	((void)id);
+	nio_coalesce_flush(NULL,nc);
+	return nc->ndirty;
+}
+
+static void _nio_coalesce_writable(elHandle *el, int fd, void *data, int mask) {
+	nioCoalesce *nc = data;
+	nioOutput *o = &nc->outputs[fd];
+	((void)mask);
+
+	if( 0 < _nio_output_flush(NULL,o,fd) )
+		return;
+	el_file_del(el,fd,EL_WRITABLE);
+	o->blocked = 0;
+}
+
+static nioOutput *_nio_coalesce_output(char *err, nioCoalesce *nc, int fd) {
+	nioOutput *o;
+
+	if( 0 > fd || nc->size <= fd ) {
+		_nio_error(err,"coalesce: fd %d out of range",fd);
+		return NULL;
+	}
+	o = &nc->outputs[fd];
+	if( o->error ) {
+		_nio_error(err,"write: %s",strerror(o->error));
+		return NULL;
+	}
+	return o;
+}
+
+static void _nio_coalesce_free(elHandle *el, void *data) {
+	nioCoalesce *nc = data;
+	int i;
+	((void)el);
+	for( i = 0; nc->size > i; ++i )
+		_nio_output_drop(&nc->outputs[i]);
+	NIO_FREE(nc->outputs);
+	NIO_FREE(nc->dirtys);
+	NIO_FREE(nc);
+}
+
+static int _nio_sampler_bucket(unsigned int value) {
+	int bucket = value ? 32 - __builtin_clz(value) : 0;
+	return NIO_TCP_BUCKETS > bucket ? bucket : NIO_TCP_BUCKETS - 1;
+}
+
+static void _nio_sampler_record(nioSampler *ns, nioTcpSample *sm) {
+	nioTcpStats *st = &ns->work;
+	int i;
+
+	st->sockets++;
+	st->rtt[_nio_sampler_bucket(sm->rtt)]++;
+	st->retrans[_nio_sampler_bucket(sm->retrans)]++;
+	st->cwnd[_nio_sampler_bucket(sm->cwnd)]++;
+	st->unacked[_nio_sampler_bucket(sm->unacked)]++;
+	st->notsent[_nio_sampler_bucket(sm->notsent)]++;
+
+	/* top holds the worst connections by rtt, worst first */
+	if( st->ntop == ns->top && sm->rtt <= st->top[st->ntop-1].rtt )
+		return;
+	if( st->ntop < ns->top )
+		st->ntop++;
+	for( i = st->ntop - 1; 0 < i && sm->rtt > st->top[i-1].rtt; --i )
+		st->top[i] = st->top[i-1];
+	st->top[i] = *sm;
+}
+
+/* Samples at most batch sockets and scans at most NIO_SAMPLER_SCAN slots of
+ * the fd table per sampled socket, then publishes at the end of a sweep. */
+static void _nio_sampler_timer(elHandle *el, long id, void *data) {
+	nioSampler *ns = data;
+	int sampled = 0, scanned = 0;
+	((void)id);
+
+	while( ns->batch > sampled && ns->batch * NIO_SAMPLER_SCAN > scanned++ ) {
+		nioTcpInfo ti;
+		nioTcpSample sm;
+		socklen_t len = sizeof(ti);
+		int fd = ns->cursor++;
+
+		if( el->size <= fd ) {
+			ns->work.sweeps = ns->stats.sweeps + 1;
+			ns->stats = ns->work;
+			memset(&ns->work,0,sizeof(ns->work));
+			ns->cursor = 0;
+			break;
+		}
+		if( EL_NONE == el->files[fd].mask )
+			continue;
+		memset(&ti,0,sizeof(ti));
+		if( NIO_ERR == getsockopt(fd,IPPROTO_TCP,TCP_INFO,&ti,&len) ||
+			TCP_LISTEN == ti.state )
+			continue;
+
+		sm.fd = fd;
+		sm.rtt = ti.rtt;
+		sm.rttvar = ti.rttvar;
+		sm.retrans = ti.total_retrans;
+		sm.cwnd = ti.snd_cwnd;
+		sm.unacked = ti.unacked;
+		sm.notsent = offsetof(nioTcpInfo,min_rtt) <= len ? ti.notsent_bytes : 0;
+		_nio_sampler_record(ns,&sm);
+		sampled++;
+	}
+	ns->id = el_time_add(el,ns->ms,_nio_sampler_timer,ns,NULL);
+}
+
+/* Reads into the loop's scratch buffer behind whatever partial message fd
+ * had kept, and hands the callback a view of it. Whatever the callback does
+ * not consume is copied out into a buffer of its own exact size. */
+static void _nio_scratch_read(elHandle *el, int fd, void *data, int mask) {
+	nioScratch *sc = data;
+	nioPartial *p = &sc->partials[fd];
+	int len = p->len, byte, used, status = NIO_OK;
+	((void)mask);
+
+	if( len ) {
+		memcpy(sc->buf,p->buf,len);
+		NIO_FREE(p->buf);
+		p->len = 0;
+	}
+
+	while( 1 ) {
+		int room = sc->size - len;
+
+		if( !room ) {
+			errno = EMSGSIZE;
+			status = NIO_ERR;
+			break;
+		}
+		byte = read(fd,sc->buf+len,room);
+		if( NIO_ERR == byte ) {
+			if( EINTR == errno )
+				continue;
+			if( EAGAIN != errno )
+				status = NIO_ERR;
+			break;
+		}
+		if( !byte ) {
+			status = NIO_DISCONNECT;
+			break;
+		}
+		len += byte;
+
+		used = p->proc(el,fd,p->data,sc->buf,len,NIO_OK);
+		if( !p->proc )
+			return;
+		if( 0 < used ) {
+			len -= used < len ? used : len;
+			memmove(sc->buf,sc->buf+used,len);
+		}
+		if( byte < room )
+			break;
+	}
+
+	if( NIO_OK != status ) {
+		p->proc(el,fd,p->data,sc->buf,len,status);
+		return;
+	}
+	if( len ) {
+		if( !(p->buf = malloc(len)) ) {
+			p->proc(el,fd,p->data,sc->buf,len,NIO_ERR);
+			return;
+		}
+		memcpy(p->buf,sc->buf,len);
+		p->len = len;
+	}
+}
+
+static void _nio_acceptor_pause(nioAcceptor *na, int reason) {
+	if( NIO_PAUSE_NONE == na->stats.paused )
+		el_file_del(na->el,na->fd,EL_READABLE);
+	if( NIO_PAUSE_FDS == reason && EL_ERR == na->id )
+		na->id = el_time_add(na->el,NIO_ACCEPT_PAUSE,_nio_acceptor_timer,na,NULL);
+	if( reason != na->stats.paused )
+		na->stats.pauses++;
+	na->stats.paused = reason;
+}
+
+static void _nio_acceptor_resume(nioAcceptor *na) {
+	if( EL_ERR != na->id ) {
+		el_time_del(na->el,na->id);
+		na->id = EL_ERR;
+	}
+	if( NIO_PAUSE_NONE == na->stats.paused )
+		return;
+	na->stats.paused = NIO_PAUSE_NONE;
+	el_file_add(na->el,na->fd,EL_READABLE,_nio_acceptor_read,na,NULL);
+}
+
+/* Out of descriptors: give up the reserve fd so the pending connections can
+ * be accepted and closed at once, rather than left to keep the listener
+ * readable and the loop spinning. */
+static void _nio_acceptor_shed(nioAcceptor *na) {
+	int c;
+
+	if( NIO_INV != na->reserve ) {
+		nio_close(na->reserve);
+		na->reserve = NIO_INV;
+	}
+	while( NIO_ERR != (c = nio_tcp_accept(NULL,na->fd,NULL,0,NULL)) ) {
+		nio_close(c);
+		na->stats.shed++;
+	}
+	na->reserve = open("/dev/null",O_RDONLY|O_CLOEXEC);
+	_nio_acceptor_pause(na,NIO_PAUSE_FDS);
+}
+
+static void _nio_acceptor_timer(elHandle *el, long id, void *data) {
+	nioAcceptor *na = data;
+	((void)el);
+	((void)id);
+	na->id = EL_ERR;
+	if( na->low >= na->stats.conns )
+		_nio_acceptor_resume(na);
+	else
+		na->stats.paused = NIO_PAUSE_CONNS;
+}
+
+static void _nio_acceptor_read(elHandle *el, int fd, void *data, int mask) {
+	nioAcceptor *na = data;
+	char ip[INET6_ADDRSTRLEN];
+	int i, c, port;
+	((void)mask);
+
+	for( i = 0; NIO_ACCEPT_BATCH > i; ++i ) {
+		if( na->high <= na->stats.conns ) {
+			_nio_acceptor_pause(na,NIO_PAUSE_CONNS);
+			return;
+		}
+		if( NIO_ERR == (c = nio_tcp_accept(NULL,fd,ip,sizeof(ip),&port)) ) {
+			if( EMFILE == errno || ENFILE == errno )
+				_nio_acceptor_shed(na);
+			else if( ECONNABORTED == errno || EPROTO == errno )
+				continue;
+			return;
+		}
+		if( el->size <= c ) {
+			nio_close(c);
+			na->stats.shed++;
+			_nio_acceptor_pause(na,NIO_PAUSE_FDS);
+			return;
+		}
+		na->stats.conns++;
+		na->stats.accepted++;
+		na->proc(el,c,ip,port,na->data);
+		if( NIO_PAUSE_NONE != na->stats.paused )
+			return;
+	}
+}
+
+static int _nio_relays_get(nioRelays *nr, int *pipefd) {
+	if( nr->num ) {
+		nr->num--;
+		pipefd[0] = nr->pipes[nr->num][0];
+		pipefd[1] = nr->pipes[nr->num][1];
+		return NIO_OK;
+	}
+	return pipe2(pipefd,O_NONBLOCK|O_CLOEXEC);
+}
+
+/* A pipe goes back to the pool only when empty; one still holding bytes
+ * of an aborted relay is closed instead. */
+static void _nio_relays_put(nioRelays *nr, nioPipe *p) {
+	if( NIO_INV == p->pipe[0] )
+		return;
+	if( !p->pending && nr->max > nr->num ) {
+		nr->pipes[nr->num][0] = p->pipe[0];
+		nr->pipes[nr->num][1] = p->pipe[1];
+		nr->num++;
+	} else {
+		nio_close(p->pipe[0]);
+		nio_close(p->pipe[1]);
+	}
+	p->pipe[0] = p->pipe[1] = NIO_INV;
+}
+
+static void _nio_relay_free(nioRelay *r) {
+	nioRelays *nr = r->nr;
+
+	if( r->mask[0] )
+		el_file_del(nr->el,r->a,r->mask[0]);
+	if( r->mask[1] )
+		el_file_del(nr->el,r->b,r->mask[1]);
+	_nio_relays_put(nr,&r->dirs[0]);
+	_nio_relays_put(nr,&r->dirs[1]);
+	if( r->prev )
+		r->prev->next = r->next;
+	else
+		nr->relays = r->next;
+	if( r->next )
+		r->next->prev = r->prev;
+	NIO_FREE(r);
+}
+
+/* Moves bytes in -> pipe -> out until neither side makes progress. The
+ * payload never leaves the kernel. */
+static int _nio_relay_pump(nioPipe *p) {
+	ssize_t byte;
+	int moved;
+
+	do {
+		moved = 0;
+		if( !p->eof && !p->full && p->cap > p->pending ) {
+			byte = splice(p->in,NULL,p->pipe[1],NULL,p->cap-p->pending,NIO_RELAY_SPLICE);
+			if( 0 < byte ) {
+				p->pending += byte;
+				moved = 1;
+			} else if( !byte ) {
+				p->eof = 1;
+			} else if( EAGAIN == errno && p->pending ) {
+				/* The pipe ran out of buffer slots before reaching cap
+				 * bytes, small segments each take a whole slot. */
+				p->full = 1;
+			} else if( EAGAIN != errno && EINTR != errno ) {
+				return NIO_ERR;
+			}
+		}
+		if( p->pending ) {
+			byte = splice(p->pipe[0],NULL,p->out,NULL,p->pending,NIO_RELAY_SPLICE);
+			if( 0 < byte ) {
+				p->pending -= byte;
+				p->full = 0;
+				moved = 1;
+			} else if( NIO_ERR == byte && EAGAIN != errno && EINTR != errno ) {
+				return NIO_ERR;
+			}
+		}
+	} while( moved );
+
+	if( p->eof && !p->pending && NIO_INV != p->out ) {
+		shutdown(p->out,SHUT_WR);
+		p->out = NIO_INV;
+	}
+	return NIO_OK;
+}
+
+/* Reads from a side only while its pipe has room, in bytes and in
+ * buffer slots, and waits for writability only while there is something
+ * queued for it. */
+static void _nio_relay_arm(nioRelay *r) {
+	int i;
+
+	for( i = 0; 2 > i; ++i ) {
+		int fd = i ? r->b : r->a;
+		nioPipe *in = &r->dirs[i], *out = &r->dirs[!i];
+		int mask = EL_NONE;
+
+		if( !in->eof && !in->full && in->cap > in->pending )
+			mask |= EL_READABLE;
+		if( out->pending )
+			mask |= EL_WRITABLE;
+
+		if( r->mask[i] & ~mask )
+			el_file_del(r->nr->el,fd,r->mask[i] & ~mask);
+		if( EL_READABLE & mask & ~r->mask[i] )
+			el_file_add(r->nr->el,fd,EL_READABLE,_nio_relay_read,r,NULL);
+		if( EL_WRITABLE & mask & ~r->mask[i] )
+			el_file_add(r->nr->el,fd,EL_WRITABLE,_nio_relay_write,r,NULL);
+		r->mask[i] = mask;
+	}
+}
+
+/* The relay ends once both directions have been shut down, or on the
+ * first error. It is unlinked from the loop before done_proc runs, so the
+ * callback may close both fds. */
+static void _nio_relay_run(nioRelay *r, nioPipe *p) {
+	elHandle *el = r->nr->el;
+	nio_relay_proc done_proc = r->done_proc;
+	void *data = r->data;
+	int a = r->a, b = r->b;
+	int status = _nio_relay_pump(p);
+
+	if( NIO_OK == status && (NIO_INV != r->dirs[0].out || NIO_INV != r->dirs[1].out) ) {
+		_nio_relay_arm(r);
+		return;
+	}
+	_nio_relay_free(r);
+	if( done_proc )
+		done_proc(el,a,b,data,status);
+}
+
+static void _nio_relay_read(elHandle *el, int fd, void *data, int mask) {
+	nioRelay *r = data;
+	((void)el);
+	((void)mask);
+	_nio_relay_run(r,&r->dirs[fd == r->b]);
+}
+
+static void _nio_relay_write(elHandle *el, int fd, void *data, int mask) {
+	nioRelay *r = data;
+	((void)el);
+	((void)mask);
+	_nio_relay_run(r,&r->dirs[fd == r->a]);
+}
+
 /* -------------------------------- api implementation ----------------------- */
 
 int nio_tcp_connect(char *err, const char *addr, int port) {
-	return _nio_tcp_generic_connect(err,addr,port,NIO_CONNECT_NONE);
+	return _nio_tcp_generic_connect(err,addr,port,NIO_CONNECT_NONE,NULL,0,NULL);
 }
 
 int nio_tcp_nonblock_connect(char *err, const char *addr, int port) {
-	return _nio_tcp_generic_connect(err,addr,port,NIO_CONNECT_NONBLOCK);
+	return _nio_tcp_generic_connect(err,addr,port,NIO_CONNECT_NONBLOCK,NULL,0,NULL);
+}
+
+int nio_tcp_fastopen_connect(char *err, const char *addr, int port, char *buf, int count, int *sent) {
+	*sent = 0;
+	return _nio_tcp_generic_connect(err,addr,port,NIO_CONNECT_NONBLOCK|NIO_CONNECT_FASTOPEN,buf,count,sent);
 }
 
 int nio_tcp_server(char *err, const char *addr, int port, int backlog) {
@@ -363,6 +1103,17 @@ int nio_enable_tcp_linger(char *err, int fd) {
 	return NIO_OK;
 }
 
+int nio_disable_tcp_linger(char *err, int fd) {
+	struct linger l;
+	l.l_onoff = 0;
+	l.l_linger = 0;
+	if( NIO_ERR == setsockopt(fd,SOL_SOCKET,SO_LINGER,&l,sizeof(l)) ) {
+		_nio_error(err,"setsockopt SO_LINGER: %s",strerror(errno));
+		return NIO_ERR;
+	}
+	return NIO_OK;
+}
+
 int nio_enable_tcp_reuseaddr(char *err, int fd) {
 	return _nio_enable_tcp_reuseaddr(err,fd,1);
 }
@@ -417,6 +1168,38 @@ int nio_enable_keepalive(char *err, int fd, int interval) {
 	return NIO_OK;
 }
 
+/* Options for listening sockets. A kernel without support keeps doing the
+ * plain handshake, so ENOPROTOOPT and EOPNOTSUPP are not reported. */
+int nio_enable_tcp_fastopen(char *err, int fd, int qlen) {
+#if defined(TCP_FASTOPEN)
+	if( NIO_ERR == setsockopt(fd,IPPROTO_TCP,TCP_FASTOPEN,&qlen,sizeof(qlen)) &&
+		ENOPROTOOPT != errno && EOPNOTSUPP != errno ) {
+		_nio_error(err,"setsockopt TCP_FASTOPEN: %s",strerror(errno));
+		return NIO_ERR;
+	}
+#else
+	((void)err);
+	((void)fd);
+	((void)qlen);
+#endif
+	return NIO_OK;
+}
+
+int nio_enable_tcp_defer_accept(char *err, int fd, int seconds) {
+#if defined(TCP_DEFER_ACCEPT)
+	if( NIO_ERR == setsockopt(fd,IPPROTO_TCP,TCP_DEFER_ACCEPT,&seconds,sizeof(seconds)) &&
+		ENOPROTOOPT != errno && EOPNOTSUPP != errno ) {
+		_nio_error(err,"setsockopt TCP_DEFER_ACCEPT: %s",strerror(errno));
+		return NIO_ERR;
+	}
+#else
+	((void)err);
+	((void)fd);
+	((void)seconds);
+#endif
+	return NIO_OK;
+}
+
 int nio_set_send_buffer(char *err, int fd, int size) {
 	if( NIO_ERR == setsockopt(fd,SOL_SOCKET,SO_SNDBUF,&size,sizeof(size)) ) {
 		_nio_error(err,"setsockopt SO_SNDBUF: %s",strerror(errno));
@@ -432,3 +1215,387 @@ int nio_set_recv_buffer(char *err, int fd, int size) {
 	}
 	return NIO_OK;
 }
+
+nioCoalesce *nio_coalesce_create(elHandle *el) {
+	nioCoalesce *nc = calloc(1,sizeof(*nc));
+	if( !nc )
+		goto err;
+	nc->outputs = calloc(el->size,sizeof(*nc->outputs));
+	if( !nc->outputs )
+		goto err;
+	nc->dirtys = calloc(el->size,sizeof(*nc->dirtys));
+	if( !nc->dirtys )
+		goto err;
+	nc->el = el;
+	nc->size = el->size;
+
+	nc->id = el_wait_add(el,_nio_coalesce_wait,nc,_nio_coalesce_free);
+	if( EL_ERR != nc->id )
+		return nc;
+err:
+	if( nc ) {
+		NIO_FREE(nc->dirtys);
+		NIO_FREE(nc->outputs);
+		NIO_FREE(nc);
+	}
+	return NULL;
+}
+
+void nio_coalesce_destroy(nioCoalesce *nc) {
+	int fd;
+	for( fd = 0; nc->size > fd; ++fd )
+		if( nc->outputs[fd].blocked )
+			el_file_del(nc->el,fd,EL_WRITABLE);
+	el_wait_del(nc->el,nc->id);
+}
+
+int nio_tcp_coalesce_write(char *err, nioCoalesce *nc, int fd, char *buf, int count) {
+	nioOutput *o;
+
+	if( !(o = _nio_coalesce_output(err,nc,fd)) )
+		return NIO_ERR;
+	if( NIO_ERR == _nio_output_append(o,buf,count) ) {
+		_nio_error(err,"coalesce: out of memory");
+		return NIO_ERR;
+	}
+	if( !o->dirty && !o->blocked ) {
+		o->dirty = 1;
+		nc->dirtys[nc->ndirty++] = fd;
+	}
+	return NIO_OK;
+}
+
+/* Flushes every output written to since the last flush. One the socket
+ * will not take in full waits on EL_WRITABLE and is flushed from there,
+ * which the coalescer owns for such fds until its output drains. */
+int nio_coalesce_flush(char *err, nioCoalesce *nc) {
+	int i, result = NIO_OK;
+
+	for( i = 0; nc->ndirty > i; ++i ) {
+		int fd = nc->dirtys[i];
+		nioOutput *o = &nc->outputs[fd];
+
+		o->dirty = 0;
+		switch( _nio_output_flush(err,o,fd) ) {
+		case NIO_ERR:
+			result = NIO_ERR;
+			break;
+		case 0:
+			break;
+		default:
+			if( EL_OK == el_file_add(nc->el,fd,EL_WRITABLE,_nio_coalesce_writable,nc,NULL) ) {
+				o->blocked = 1;
+			} else {
+				_nio_error(err,"coalesce: fd %d not added",fd);
+				o->error = EBADF;
+				_nio_output_drop(o);
+				result = NIO_ERR;
+			}
+			break;
+		}
+	}
+	nc->ndirty = 0;
+	return result;
+}
+
+int nio_coalesce_pending(nioCoalesce *nc, int fd) {
+	nioOutput *o;
+	int i, pending = 0;
+
+	if( 0 > fd || nc->size <= fd )
+		return 0;
+	o = &nc->outputs[fd];
+	for( i = 0; o->num > i; ++i )
+		pending += o->chunks[i].len - o->chunks[i].off;
+	return pending;
+}
+
+void nio_coalesce_clear(nioCoalesce *nc, int fd) {
+	if( 0 > fd || nc->size <= fd )
+		return;
+	if( nc->outputs[fd].blocked ) {
+		el_file_del(nc->el,fd,EL_WRITABLE);
+		nc->outputs[fd].blocked = 0;
+	}
+	_nio_output_drop(&nc->outputs[fd]);
+	nc->outputs[fd].error = 0;
+}
+
+nioBuffer *nio_buffer_create(const char *buf, int len) {
+	nioBuffer *nb;
+
+	if( 0 > len || !(nb = malloc(sizeof(*nb)+len)) )
+		return NULL;
+	nb->ref = 1;
+	nb->len = len;
+	if( buf )
+		memcpy(nb->data,buf,len);
+	return nb;
+}
+
+nioBuffer *nio_buffer_retain(nioBuffer *nb) {
+	__atomic_add_fetch(&nb->ref,1,__ATOMIC_RELAXED);
+	return nb;
+}
+
+void nio_buffer_release(nioBuffer *nb) {
+	if( nb && !__atomic_sub_fetch(&nb->ref,1,__ATOMIC_ACQ_REL) )
+		free(nb);
+}
+
+int nio_tcp_coalesce_write_buffer(char *err, nioCoalesce *nc, int fd, nioBuffer *nb) {
+	nioOutput *o;
+
+	if( !(o = _nio_coalesce_output(err,nc,fd)) )
+		return NIO_ERR;
+	if( NIO_ERR == _nio_output_append_buffer(o,nb) ) {
+		_nio_error(err,"coalesce: out of memory");
+		return NIO_ERR;
+	}
+	if( !o->dirty && !o->blocked ) {
+		o->dirty = 1;
+		nc->dirtys[nc->ndirty++] = fd;
+	}
+	return NIO_OK;
+}
+
+/* Queues nb to every fd, then flushes all dirty outputs in one pass. Each
+ * queue holds a reference, so memory stays O(message) however many fds
+ * it goes to. Returns the number of fds it was queued to; err describes
+ * the last one that failed. */
+int nio_broadcast(char *err, nioCoalesce *nc, int *fds, int n, nioBuffer *nb) {
+	int i, queued = 0;
+
+	for( i = 0; n > i; ++i )
+		if( NIO_OK == nio_tcp_coalesce_write_buffer(err,nc,fds[i],nb) )
+			queued++;
+	nio_coalesce_flush(err,nc);
+	return queued;
+}
+
+nioSampler *nio_sampler_create(elHandle *el, long ms, int batch, int top) {
+	nioSampler *ns = calloc(1,sizeof(*ns));
+	if( !ns )
+		return NULL;
+	ns->el = el;
+	ns->ms = 0 < ms ? ms : 1;
+	ns->batch = 0 < batch ? batch : 1;
+	ns->top = 0 < top && NIO_TCP_TOP >= top ? top : NIO_TCP_TOP;
+
+	ns->id = el_time_add(el,ns->ms,_nio_sampler_timer,ns,NULL);
+	if( EL_ERR != ns->id )
+		return ns;
+	NIO_FREE(ns);
+	return NULL;
+}
+
+void nio_sampler_destroy(nioSampler *ns) {
+	el_time_del(ns->el,ns->id);
+	NIO_FREE(ns);
+}
+
+void nio_sampler_stats(nioSampler *ns, nioTcpStats *stats) {
+	*stats = ns->stats;
+}
+
+nioScratch *nio_scratch_create(elHandle *el, int size) {
+	nioScratch *sc = calloc(1,sizeof(*sc));
+	if( !sc )
+		goto err;
+	sc->el = el;
+	sc->size = 0 < size ? size : NIO_SCRATCH_SIZE;
+	sc->buf = malloc(sc->size);
+	if( !sc->buf )
+		goto err;
+	sc->partials = calloc(el->size,sizeof(*sc->partials));
+	if( sc->partials )
+		return sc;
+err:
+	if( sc ) {
+		NIO_FREE(sc->buf);
+		NIO_FREE(sc);
+	}
+	return NULL;
+}
+
+void nio_scratch_destroy(nioScratch *sc) {
+	int fd;
+	for( fd = 0; sc->el->size > fd; ++fd ) {
+		if( sc->partials[fd].proc )
+			nio_scratch_del(sc,fd);
+	}
+	NIO_FREE(sc->partials);
+	NIO_FREE(sc->buf);
+	NIO_FREE(sc);
+}
+
+/* Registers fd for EL_READABLE in scratch mode. proc returns how many bytes
+ * of the view it consumed; status is NIO_DISCONNECT or NIO_ERR once, with
+ * the unconsumed bytes, when the connection ends and fd must be closed. */
+int nio_scratch_add(char *err, nioScratch *sc, int fd, nio_scratch_proc proc, void *data) {
+	nioPartial *p;
+
+	if( 0 > fd || sc->el->size <= fd ) {
+		_nio_error(err,"scratch: fd %d out of range",fd);
+		return NIO_ERR;
+	}
+	p = &sc->partials[fd];
+	NIO_FREE(p->buf);
+	p->len = 0;
+	p->proc = proc;
+	p->data = data;
+	if( EL_ERR == el_file_add(sc->el,fd,EL_READABLE,_nio_scratch_read,sc,NULL) ) {
+		_nio_error(err,"epoll_ctl: %s",strerror(errno));
+		p->proc = NULL;
+		return NIO_ERR;
+	}
+	return NIO_OK;
+}
+
+void nio_scratch_del(nioScratch *sc, int fd) {
+	nioPartial *p;
+
+	if( 0 > fd || sc->el->size <= fd )
+		return;
+	p = &sc->partials[fd];
+	if( p->proc )
+		el_file_del(sc->el,fd,EL_READABLE);
+	NIO_FREE(p->buf);
+	memset(p,0,sizeof(*p));
+}
+
+/* Accepts on listening fd for the loop and pauses its EL_READABLE interest
+ * while maxconn connections are open or descriptors run out. Accepting
+ * resumes once the count falls to 90% of maxconn; after running out of
+ * descriptors it is retried every NIO_ACCEPT_PAUSE ms. Every connection
+ * handed to proc must be reported back with nio_acceptor_release. */
+nioAcceptor *nio_acceptor_create(char *err, elHandle *el, int fd, int maxconn,
+		nio_accept_proc proc, void *data) {
+	nioAcceptor *na = calloc(1,sizeof(*na));
+
+	if( !na ) {
+		_nio_error(err,"acceptor: out of memory");
+		return NULL;
+	}
+	na->el = el;
+	na->fd = fd;
+	na->id = EL_ERR;
+	na->high = 0 < maxconn ? maxconn : el->size;
+	na->low = na->high - na->high / 10;
+	if( na->low >= na->high )
+		na->low = na->high - 1;
+	na->proc = proc;
+	na->data = data;
+
+	if( NIO_INV == (na->reserve = open("/dev/null",O_RDONLY|O_CLOEXEC)) ) {
+		_nio_error(err,"open /dev/null: %s",strerror(errno));
+		goto err;
+	}
+	if( NIO_ERR == _nio_enable_tcp_nonblock(err,fd,1) )
+		goto err;
+	if( EL_ERR == el_file_add(el,fd,EL_READABLE,_nio_acceptor_read,na,NULL) ) {
+		_nio_error(err,"acceptor: fd %d not added",fd);
+		goto err;
+	}
+	return na;
+err:
+	if( NIO_INV != na->reserve )
+		nio_close(na->reserve);
+	NIO_FREE(na);
+	return NULL;
+}
+
+void nio_acceptor_destroy(nioAcceptor *na) {
+	if( EL_ERR != na->id )
+		el_time_del(na->el,na->id);
+	if( NIO_PAUSE_NONE == na->stats.paused )
+		el_file_del(na->el,na->fd,EL_READABLE);
+	if( NIO_INV != na->reserve )
+		nio_close(na->reserve);
+	NIO_FREE(na);
+}
+
+void nio_acceptor_release(nioAcceptor *na) {
+	if( 0 < na->stats.conns )
+		na->stats.conns--;
+	if( NIO_PAUSE_NONE != na->stats.paused && na->low >= na->stats.conns )
+		_nio_acceptor_resume(na);
+}
+
+void nio_acceptor_stats(nioAcceptor *na, nioAcceptStats *stats) {
+	*stats = na->stats;
+}
+
+/* Pools up to max idle pipe pairs for splice relays on the loop. */
+nioRelays *nio_relays_create(elHandle *el, int max) {
+	nioRelays *nr = calloc(1,sizeof(*nr));
+	if( !nr )
+		return NULL;
+	nr->el = el;
+	nr->max = 0 < max ? max : 0;
+	if( nr->max && !(nr->pipes = calloc(nr->max,sizeof(*nr->pipes))) ) {
+		NIO_FREE(nr);
+		return NULL;
+	}
+	return nr;
+}
+
+/* Tears down any relay still running without calling its done_proc; the
+ * fds stay open and belong to the caller. */
+void nio_relays_destroy(nioRelays *nr) {
+	int i;
+	while( nr->relays )
+		_nio_relay_free(nr->relays);
+	for( i = 0; nr->num > i; ++i ) {
+		nio_close(nr->pipes[i][0]);
+		nio_close(nr->pipes[i][1]);
+	}
+	NIO_FREE(nr->pipes);
+	NIO_FREE(nr);
+}
+
+/* Relays bytes between a and b in both directions with splice() through a
+ * pipe pair per direction. The relay takes over the loop events of both
+ * fds. EOF on one side is passed on as shutdown(SHUT_WR) of the other, and
+ * done_proc runs once both directions are finished (NIO_OK) or either
+ * fails (NIO_ERR). Closing the fds is left to done_proc. */
+int nio_relay(char *err, nioRelays *nr, int a, int b, nio_relay_proc done_proc, void *data) {
+	nioRelay *r;
+	int i;
+
+	if( 0 > a || 0 > b || nr->el->size <= a || nr->el->size <= b || a == b ) {
+		_nio_error(err,"relay: fd %d/%d out of range",a,b);
+		return NIO_ERR;
+	}
+	if( NIO_ERR == _nio_enable_tcp_nonblock(err,a,1) ||
+		NIO_ERR == _nio_enable_tcp_nonblock(err,b,1) )
+		return NIO_ERR;
+	if( !(r = calloc(1,sizeof(*r))) ) {
+		_nio_error(err,"relay: out of memory");
+		return NIO_ERR;
+	}
+	r->nr = nr;
+	r->a = a;
+	r->b = b;
+	r->done_proc = done_proc;
+	r->data = data;
+	for( i = 0; 2 > i; ++i ) {
+		nioPipe *p = &r->dirs[i];
+		p->in = i ? b : a;
+		p->out = i ? a : b;
+		if( NIO_ERR == _nio_relays_get(nr,p->pipe) ) {
+			_nio_error(err,"pipe: %s",strerror(errno));
+			p->pipe[0] = p->pipe[1] = NIO_INV;
+			_nio_relays_put(nr,&r->dirs[0]);
+			NIO_FREE(r);
+			return NIO_ERR;
+		}
+		if( 0 >= (p->cap = fcntl(p->pipe[0],F_GETPIPE_SZ)) )
+			p->cap = 16 * 4096;
+	}
+	if( (r->next = nr->relays) )
+		r->next->prev = r;
+	nr->relays = r;
+	_nio_relay_arm(r);
+	return NIO_OK;
+}
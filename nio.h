@@ -21,10 +21,74 @@ extern "C" {
 
 #define nio_close(_f) close(_f)
 
+#define NIO_TCP_BUCKETS 32
+#define NIO_TCP_TOP 32
+
+#define NIO_PAUSE_NONE 0
+#define NIO_PAUSE_CONNS 1
+#define NIO_PAUSE_FDS 2
+
+/* -------------------------------- struct ----------------------------------- */
+
+struct elHandle;
+
+typedef struct nioCoalesce nioCoalesce;
+typedef struct nioSampler nioSampler;
+typedef struct nioScratch nioScratch;
+typedef struct nioAcceptor nioAcceptor;
+typedef struct nioRelays nioRelays;
+
+typedef int (*nio_scratch_proc)(struct elHandle *el, int fd, void *data,
+		char *buf, int len, int status);
+typedef void (*nio_accept_proc)(struct elHandle *el, int fd, char *ip, int port, void *data);
+typedef void (*nio_relay_proc)(struct elHandle *el, int a, int b, void *data, int status);
+
+/* Immutable once created; shared by every output queue it is written to
+ * and freed when the last reference is released. */
+typedef struct nioBuffer {
+	int ref;
+	int len;
+	char data[];
+} nioBuffer;
+
+typedef struct nioTcpSample {
+	int fd;
+	unsigned int rtt;
+	unsigned int rttvar;
+	unsigned int retrans;
+	unsigned int cwnd;
+	unsigned int unacked;
+	unsigned int notsent;
+} nioTcpSample;
+
+/* Bucket i of each histogram counts values in [2^(i-1), 2^i), bucket 0 the
+ * zeros. rtt is in microseconds, cwnd and unacked in segments, notsent in
+ * bytes, retrans is the connection's total retransmits. */
+typedef struct nioTcpStats {
+	long sweeps;
+	long sockets;
+	long rtt[NIO_TCP_BUCKETS];
+	long retrans[NIO_TCP_BUCKETS];
+	long cwnd[NIO_TCP_BUCKETS];
+	long unacked[NIO_TCP_BUCKETS];
+	long notsent[NIO_TCP_BUCKETS];
+	int ntop;
+	nioTcpSample top[NIO_TCP_TOP];
+} nioTcpStats;
+
+typedef struct nioAcceptStats {
+	long accepted;
+	long shed;
+	long pauses;
+	int conns;
+	int paused;
+} nioAcceptStats;
+
 /* -------------------------------- api functions ---------------------------- */
 
 int nio_tcp_connect(char *err, const char *addr, int port);
 int nio_tcp_nonblock_connect(char *err, const char *addr, int port);
+int nio_tcp_fastopen_connect(char *err, const char *addr, int port, char *buf, int count, int *sent);
 int nio_tcp_server(char *err, const char *addr, int port, int backlog);
 int nio_tcp6_server(char *err, const char *addr, int port, int backlog);
 int nio_tcp_accept(char *err, int fd, char *ip, size_t iplen, int *port);
@@ -36,6 +100,7 @@ int nio_tcp_nonblock_write(char *err, int fd, char *buf, int count);
 int nio_enable_tcp_nonblock(char *err, int fd);
 int nio_disable_tcp_nonblock(char *err, int fd);
 int nio_enable_tcp_linger(char *err, int fd);
+int nio_disable_tcp_linger(char *err, int fd);
 int nio_enable_tcp_reuseaddr(char *err, int fd);
 int nio_disable_tcp_reuseaddr(char *err, int fd);
 int nio_enable_tcp_nodelay(char *err, int fd);
@@ -43,10 +108,46 @@ int nio_disable_tcp_nodelay(char *err, int fd);
 int nio_enable_tcp_keepalive(char *err, int fd);
 int nio_disable_tcp_keepalive(char *err, int fd);
 int nio_enable_keepalive(char *err, int fd, int interval);
+int nio_enable_tcp_fastopen(char *err, int fd, int qlen);
+int nio_enable_tcp_defer_accept(char *err, int fd, int seconds);
 
 int nio_set_send_buffer(char *err, int fd, int size);
 int nio_set_recv_buffer(char *err, int fd, int size);
 
+nioCoalesce *nio_coalesce_create(struct elHandle *el);
+void nio_coalesce_destroy(nioCoalesce *nc);
+int nio_tcp_coalesce_write(char *err, nioCoalesce *nc, int fd, char *buf, int count);
+int nio_coalesce_flush(char *err, nioCoalesce *nc);
+int nio_coalesce_pending(nioCoalesce *nc, int fd);
+/* Must be called before closing fd, or its error and queued chunks carry
+ * over to the next connection that reuses the fd number. */
+void nio_coalesce_clear(nioCoalesce *nc, int fd);
+
+nioBuffer *nio_buffer_create(const char *buf, int len);
+nioBuffer *nio_buffer_retain(nioBuffer *nb);
+void nio_buffer_release(nioBuffer *nb);
+int nio_tcp_coalesce_write_buffer(char *err, nioCoalesce *nc, int fd, nioBuffer *nb);
+int nio_broadcast(char *err, nioCoalesce *nc, int *fds, int n, nioBuffer *nb);
+
+nioSampler *nio_sampler_create(struct elHandle *el, long ms, int batch, int top);
+void nio_sampler_destroy(nioSampler *ns);
+void nio_sampler_stats(nioSampler *ns, nioTcpStats *stats);
+
+nioScratch *nio_scratch_create(struct elHandle *el, int size);
+void nio_scratch_destroy(nioScratch *sc);
+int nio_scratch_add(char *err, nioScratch *sc, int fd, nio_scratch_proc proc, void *data);
+void nio_scratch_del(nioScratch *sc, int fd);
+
+nioAcceptor *nio_acceptor_create(char *err, struct elHandle *el, int fd, int maxconn,
+		nio_accept_proc proc, void *data);
+void nio_acceptor_destroy(nioAcceptor *na);
+void nio_acceptor_release(nioAcceptor *na);
+void nio_acceptor_stats(nioAcceptor *na, nioAcceptStats *stats);
+
+nioRelays *nio_relays_create(struct elHandle *el, int max);
+void nio_relays_destroy(nioRelays *nr);
+int nio_relay(char *err, nioRelays *nr, int a, int b, nio_relay_proc done_proc, void *data);
+
 #ifdef __cplusplus
 }
 #endif
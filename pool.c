@@ -0,0 +1,382 @@
+/* Outbound Connection Pool.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "el.h"
+#include "nio.h"
+#include "pool.h"
+
+/* -------------------------------- struct ----------------------------------- */
+
+typedef struct poolIdle {
+	int fd;
+	long since;
+} poolIdle;
+
+typedef struct poolWaiter {
+	struct poolHost *host;
+	pool_get_proc proc;
+	void *data;
+	long queued;
+	struct poolWaiter *next;
+} poolWaiter;
+
+typedef struct poolHost {
+	char *addr;
+	int port;
+	int active;
+	int nidle;
+	poolIdle *idles;
+	poolWaiter *head;
+	poolWaiter *tail;
+	struct poolHost *next;
+} poolHost;
+
+/* Per fd: the host a pooled connection belongs to, and the waiter it is
+ * being connected for while the connect is in flight. */
+typedef struct poolSlot {
+	poolHost *host;
+	poolWaiter *connecting;
+} poolSlot;
+
+/* -------------------------------- define ----------------------------------- */
+
+#define POOL_ERR_LEN 256
+#define POOL_SWEEP_MIN 10
+
+#define POOL_FREE(_p) \
+	do { if(_p) { free(_p); _p = NULL; } } while(0)
+
+/* -------------------------------- private ---------------------------------- */
+
+static long _pool_now(void);
+static int _pool_alive(int fd);
+static poolHost *_pool_host(poolHandle *ph, const char *addr, int port);
+static void _pool_waited(poolHandle *ph, poolWaiter *w);
+static int _pool_connect(char *err, poolHandle *ph, poolWaiter *w);
+static void _pool_drain(poolHandle *ph, poolHost *h);
+static void _pool_connected(elHandle *el, int fd, void *data, int mask);
+static void _pool_sweep(elHandle *el, long id, void *data);
+
+/* -------------------------------- private implementation ------------------- */
+
+static long _pool_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* An idle upstream socket should have nothing to read. EOF means the peer
+ * closed it, and stray bytes mean the previous exchange was not drained;
+ * neither is safe to reuse. */
+static int _pool_alive(int fd) {
+	char c;
+	int byte = recv(fd,&c,1,MSG_PEEK|MSG_DONTWAIT);
+	return NIO_ERR == byte && (EAGAIN == errno || EWOULDBLOCK == errno);
+}
+
+static poolHost *_pool_host(poolHandle *ph, const char *addr, int port) {
+	poolHost *h;
+
+	for( h = ph->hosts; h; h = h->next )
+		if( port == h->port && !strcmp(addr,h->addr) )
+			return h;
+	if( !(h = calloc(1,sizeof(*h))) )
+		return NULL;
+	if( !(h->addr = strdup(addr)) ||
+		(ph->max_idle && !(h->idles = calloc(ph->max_idle,sizeof(*h->idles)))) ) {
+		POOL_FREE(h->addr);
+		POOL_FREE(h);
+		return NULL;
+	}
+	h->port = port;
+	h->next = ph->hosts;
+	ph->hosts = h;
+	return h;
+}
+
+static void _pool_waited(poolHandle *ph, poolWaiter *w) {
+	long us = _pool_now() - w->queued;
+	ph->stats.wait_us += us;
+	if( us > ph->stats.max_wait_us )
+		ph->stats.max_wait_us = us;
+}
+
+/* Starts a non-blocking connect on behalf of w, which has already been
+ * counted as active on its host. On failure the slot is given back and w
+ * is left to the caller. */
+static int _pool_connect(char *err, poolHandle *ph, poolWaiter *w) {
+	poolSlot *slots = ph->slots;
+	int fd;
+
+	if( NIO_ERR == (fd = nio_tcp_nonblock_connect(err,w->host->addr,w->host->port)) )
+		goto err;
+	if( ph->el->size <= fd ||
+		EL_ERR == el_file_add(ph->el,fd,EL_WRITABLE,_pool_connected,ph,NULL) ) {
+		if( err )
+			snprintf(err,POOL_ERR_LEN-1,"pool: fd %d out of range",fd);
+		nio_close(fd);
+		goto err;
+	}
+	slots[fd].host = w->host;
+	slots[fd].connecting = w;
+	return POOL_OK;
+err:
+	w->host->active--;
+	ph->stats.failed++;
+	return POOL_ERR;
+}
+
+/* Starts connects for queued waiters while the host is below max_active. */
+static void _pool_drain(poolHandle *ph, poolHost *h) {
+	poolWaiter *w;
+
+	while( (w = h->head) && (!ph->max_active || ph->max_active > h->active) ) {
+		if( !(h->head = w->next) )
+			h->tail = NULL;
+		w->next = NULL;
+		_pool_waited(ph,w);
+		h->active++;
+		ph->stats.misses++;
+		if( POOL_OK == _pool_connect(NULL,ph,w) )
+			continue;
+		w->proc(ph,NIO_INV,w->data,POOL_ERR);
+		POOL_FREE(w);
+	}
+}
+
+static void _pool_connected(elHandle *el, int fd, void *data, int mask) {
+	poolHandle *ph = data;
+	poolSlot *s = &((poolSlot *)ph->slots)[fd];
+	poolWaiter *w = s->connecting;
+	pool_get_proc proc = w->proc;
+	void *wdata = w->data;
+	int error = 0;
+	socklen_t len = sizeof(error);
+	((void)mask);
+
+	el_file_del(el,fd,EL_WRITABLE);
+	s->connecting = NULL;
+	POOL_FREE(w);
+
+	if( NIO_ERR == getsockopt(fd,SOL_SOCKET,SO_ERROR,&error,&len) || error ) {
+		poolHost *h = s->host;
+
+		h->active--;
+		s->host = NULL;
+		ph->stats.failed++;
+		nio_close(fd);
+		proc(ph,NIO_INV,wdata,POOL_ERR);
+		_pool_drain(ph,h);
+		return;
+	}
+	proc(ph,fd,wdata,POOL_OK);
+}
+
+/* Closes idle connections unused for idle_ms. Idles are kept oldest first,
+ * so each host only needs its leading run trimmed. */
+static void _pool_sweep(elHandle *el, long id, void *data) {
+	poolHandle *ph = data;
+	poolSlot *slots = ph->slots;
+	long now = _pool_now();
+	poolHost *h;
+	int i;
+	((void)id);
+
+	for( h = ph->hosts; h; h = h->next ) {
+		for( i = 0; h->nidle > i; ++i ) {
+			if( now - h->idles[i].since < ph->idle_ms * 1000 )
+				break;
+			slots[h->idles[i].fd].host = NULL;
+			nio_close(h->idles[i].fd);
+			ph->stats.evicted++;
+		}
+		if( i ) {
+			h->nidle -= i;
+			memmove(h->idles,h->idles+i,h->nidle*sizeof(*h->idles));
+		}
+	}
+	ph->id = el_time_add(el,POOL_SWEEP_MIN < ph->idle_ms / 4 ? ph->idle_ms / 4 : POOL_SWEEP_MIN,
+		_pool_sweep,ph,NULL);
+}
+
+/* -------------------------------- api implementation ----------------------- */
+
+/* Pools connections per addr:port on the loop. At most max_active are
+ * checked out or connecting per upstream (0 for no limit), and at most
+ * max_idle kept for reuse, each closed after idle_ms unused (0 to keep
+ * them until checkout finds them dead). */
+poolHandle *pool_create(elHandle *el, int max_idle, int max_active, long idle_ms) {
+	poolHandle *ph = calloc(1,sizeof(*ph));
+
+	if( !ph )
+		return NULL;
+	ph->el = el;
+	ph->id = EL_ERR;
+	ph->max_idle = 0 < max_idle ? max_idle : 0;
+	ph->max_active = 0 < max_active ? max_active : 0;
+	ph->idle_ms = 0 < idle_ms ? idle_ms : 0;
+	if( !(ph->slots = calloc(el->size,sizeof(poolSlot))) )
+		goto err;
+	if( ph->idle_ms && EL_ERR == (ph->id = el_time_add(el,
+		POOL_SWEEP_MIN < ph->idle_ms / 4 ? ph->idle_ms / 4 : POOL_SWEEP_MIN,
+		_pool_sweep,ph,NULL)) )
+		goto err;
+	return ph;
+err:
+	POOL_FREE(ph->slots);
+	POOL_FREE(ph);
+	return NULL;
+}
+
+/* Closes idle and connecting sockets and fails every queued or connecting
+ * pool_get with POOL_ERR. Checked out connections stay with their owners. */
+void pool_destroy(poolHandle *ph) {
+	poolSlot *slots = ph->slots;
+	poolHost *h;
+	poolWaiter *w;
+	int fd, i;
+
+	if( EL_ERR != ph->id )
+		el_time_del(ph->el,ph->id);
+	for( fd = 0; ph->el->size > fd; ++fd ) {
+		if( !(w = slots[fd].connecting) )
+			continue;
+		el_file_del(ph->el,fd,EL_WRITABLE);
+		nio_close(fd);
+		w->proc(ph,NIO_INV,w->data,POOL_ERR);
+		POOL_FREE(w);
+	}
+	while( (h = ph->hosts) ) {
+		ph->hosts = h->next;
+		for( i = 0; h->nidle > i; ++i )
+			nio_close(h->idles[i].fd);
+		while( (w = h->head) ) {
+			h->head = w->next;
+			w->proc(ph,NIO_INV,w->data,POOL_ERR);
+			POOL_FREE(w);
+		}
+		POOL_FREE(h->idles);
+		POOL_FREE(h->addr);
+		POOL_FREE(h);
+	}
+	POOL_FREE(ph->slots);
+	POOL_FREE(ph);
+}
+
+/* Hands proc a connection to addr:port. A live idle one is passed before
+ * pool_get returns; otherwise proc runs once a new connect completes, or,
+ * with max_active reached, once another connection is put back. Returns
+ * POOL_ERR, without calling proc, when nothing could be started. */
+int pool_get(char *err, poolHandle *ph, const char *addr, int port,
+		pool_get_proc proc, void *data) {
+	poolSlot *slots = ph->slots;
+	poolHost *h = _pool_host(ph,addr,port);
+	poolWaiter *w;
+
+	if( !h ) {
+		if( err )
+			snprintf(err,POOL_ERR_LEN-1,"pool: out of memory");
+		return POOL_ERR;
+	}
+	while( h->nidle ) {
+		int fd = h->idles[--h->nidle].fd;
+
+		if( _pool_alive(fd) ) {
+			h->active++;
+			ph->stats.hits++;
+			proc(ph,fd,data,POOL_OK);
+			return POOL_OK;
+		}
+		slots[fd].host = NULL;
+		nio_close(fd);
+		ph->stats.dead++;
+	}
+
+	if( !(w = calloc(1,sizeof(*w))) ) {
+		if( err )
+			snprintf(err,POOL_ERR_LEN-1,"pool: out of memory");
+		return POOL_ERR;
+	}
+	w->host = h;
+	w->proc = proc;
+	w->data = data;
+	w->queued = _pool_now();
+
+	if( ph->max_active && ph->max_active <= h->active ) {
+		if( h->tail )
+			h->tail->next = w;
+		else
+			h->head = w;
+		h->tail = w;
+		ph->stats.waits++;
+		return POOL_OK;
+	}
+	h->active++;
+	ph->stats.misses++;
+	if( POOL_OK == _pool_connect(err,ph,w) )
+		return POOL_OK;
+	POOL_FREE(w);
+	return POOL_ERR;
+}
+
+/* Returns fd, taken with pool_get, to the pool. A reusable connection goes
+ * straight to the oldest waiter if there is one, else back to the idle
+ * list while there is room; anything else is closed, and a waiter then
+ * gets a fresh connect. */
+void pool_put(poolHandle *ph, int fd, int reusable) {
+	poolSlot *slots = ph->slots;
+	poolHost *h;
+	poolWaiter *w;
+
+	if( 0 > fd || ph->el->size <= fd || !(h = slots[fd].host) || slots[fd].connecting ) {
+		if( 0 <= fd )
+			nio_close(fd);
+		return;
+	}
+	if( reusable && h->head ) {
+		w = h->head;
+		if( !(h->head = w->next) )
+			h->tail = NULL;
+		_pool_waited(ph,w);
+		ph->stats.hits++;
+		w->proc(ph,fd,w->data,POOL_OK);
+		POOL_FREE(w);
+		return;
+	}
+
+	h->active--;
+	if( reusable && ph->max_idle > h->nidle ) {
+		h->idles[h->nidle].fd = fd;
+		h->idles[h->nidle].since = _pool_now();
+		h->nidle++;
+	} else {
+		slots[fd].host = NULL;
+		nio_close(fd);
+	}
+
+	_pool_drain(ph,h);
+}
+
+void pool_stats(poolHandle *ph, poolStats *stats) {
+	poolHost *h;
+	poolWaiter *w;
+
+	*stats = ph->stats;
+	stats->active = stats->idle = stats->waiting = 0;
+	for( h = ph->hosts; h; h = h->next ) {
+		stats->active += h->active;
+		stats->idle += h->nidle;
+		for( w = h->head; w; w = w->next )
+			stats->waiting++;
+	}
+}
@@ -0,0 +1,70 @@
+/* Outbound Connection Pool.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ */
+
+#ifndef __POOL_H_
+#define __POOL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* -------------------------------- define ----------------------------------- */
+
+#define POOL_OK 0
+#define POOL_ERR -1
+
+/* -------------------------------- struct ----------------------------------- */
+
+struct elHandle;
+struct poolHandle;
+
+/* Called with a connected fd and POOL_OK, or with -1 and POOL_ERR when the
+ * connection could not be made or the pool is destroyed first. */
+typedef void (*pool_get_proc)(struct poolHandle *ph, int fd, void *data, int status);
+
+/* hits are checkouts served from an idle or handed-over connection, misses
+ * the ones that had to connect, queued or not, so every checkout counts as
+ * one or the other. waits counts those queued behind max_active. dead
+ * counts idle sockets found closed on checkout, evicted the ones closed
+ * for idling past idle_ms. wait_us sums the time waiters spent queued. */
+typedef struct poolStats {
+	long hits;
+	long misses;
+	long waits;
+	long failed;
+	long dead;
+	long evicted;
+	long wait_us;
+	long max_wait_us;
+	int active;
+	int idle;
+	int waiting;
+} poolStats;
+
+typedef struct poolHandle {
+	int max_idle;
+	int max_active;
+	long idle_ms;
+	long id;
+	void *hosts;
+	void *slots;
+	struct elHandle *el;
+	poolStats stats;
+} poolHandle;
+
+/* -------------------------------- api functions ---------------------------- */
+
+poolHandle *pool_create(struct elHandle *el, int max_idle, int max_active, long idle_ms);
+void pool_destroy(poolHandle *ph);
+int pool_get(char *err, poolHandle *ph, const char *addr, int port,
+		pool_get_proc proc, void *data);
+void pool_put(poolHandle *ph, int fd, int reusable);
+void pool_stats(poolHandle *ph, poolStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __POOL_H_ */
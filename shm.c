@@ -0,0 +1,488 @@
+/* Shared Memory Ring Transport.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+/* -------------------------------- define ----------------------------------- */
+
+#define SHM_ERR_LEN 256
+#define SHM_INV -1
+
+#define SHM_SPIN_MIN 16
+#define SHM_SPIN_MAX 4096
+#define SHM_EVENTFDS 4
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHM_PAUSE() __builtin_ia32_pause()
+#else
+#define SHM_PAUSE() do { } while(0)
+#endif
+
+#define SHM_CLOSE(_f) \
+	do { if(SHM_INV != _f) { close(_f); _f = SHM_INV; } } while(0)
+#define SHM_FREE(_p) \
+	do { if(_p) { free(_p); _p = NULL; } } while(0)
+
+/* -------------------------------- private ---------------------------------- */
+
+static void _shm_error(char *err, const char *fmt, ...);
+
+static size_t _shm_ring_len(uint32_t size);
+static uint32_t _shm_ring_avail(shmRing *r, uint32_t size);
+static int _shm_peer_gone(shmHandle *sh);
+static void _shm_notify(int fd);
+static int _shm_drain(int fd);
+static int _shm_watch(char *err, int fd, int efd);
+
+static shmHandle *_shm_create(char *err, int fd, int mfd, const int *efds, uint32_t size, int server);
+
+/* -------------------------------- private implementation ------------------- */
+
+static void _shm_error(char *err, const char *fmt, ...) {
+	va_list ap;
+	if( !err )
+		return;
+	va_start(ap,fmt);
+	vsnprintf(err,SHM_ERR_LEN-1,fmt,ap);
+	va_end(ap);
+}
+
+static size_t _shm_ring_len(uint32_t size) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	return (sizeof(shmRing) + size + page - 1) / page * page;
+}
+
+/* head and tail live in memory the peer can write, so the distance is
+ * clamped to the ring size agreed in the handshake. */
+static uint32_t _shm_ring_avail(shmRing *r, uint32_t size) {
+	uint64_t tail = __atomic_load_n(&r->tail,__ATOMIC_ACQUIRE);
+	uint64_t avail = tail - r->head;
+	return avail < size ? (uint32_t)avail : size;
+}
+
+/* The control socket only ever carries the handshake, so EOF on it means the
+ * peer exited without shm_close. */
+static int _shm_peer_gone(shmHandle *sh) {
+	char c;
+	return 0 == recv(sh->fd,&c,1,MSG_PEEK|MSG_DONTWAIT);
+}
+
+static void _shm_notify(int fd) {
+	uint64_t one = 1;
+	while( sizeof(one) != write(fd,&one,sizeof(one)) && EINTR == errno )
+		;
+}
+
+static int _shm_drain(int fd) {
+	uint64_t count = 0;
+	while( SHM_ERR == read(fd,&count,sizeof(count)) ) {
+		if( EINTR != errno )
+			return 0;
+	}
+	return 0 != count;
+}
+
+/* Returns an epoll descriptor that is readable when efd is signalled or the
+ * control socket fd reports the peer gone. */
+static int _shm_watch(char *err, int fd, int efd) {
+	struct epoll_event ee = {0};
+	int ep;
+
+	if( SHM_INV == (ep = epoll_create1(EPOLL_CLOEXEC)) ) {
+		_shm_error(err,"epoll_create1: %s",strerror(errno));
+		return SHM_INV;
+	}
+	ee.events = EPOLLIN;
+	ee.data.fd = efd;
+	if( SHM_ERR == epoll_ctl(ep,EPOLL_CTL_ADD,efd,&ee) ) {
+		_shm_error(err,"epoll_ctl: %s",strerror(errno));
+		close(ep);
+		return SHM_INV;
+	}
+	ee.events = EPOLLIN|EPOLLRDHUP;
+	ee.data.fd = fd;
+	if( SHM_ERR == epoll_ctl(ep,EPOLL_CTL_ADD,fd,&ee) ) {
+		_shm_error(err,"epoll_ctl: %s",strerror(errno));
+		close(ep);
+		return SHM_INV;
+	}
+	return ep;
+}
+
+/* efds are, in handshake order: data notifications for the server's ring and
+ * for the client's, then room notifications for the server's writes and for
+ * the client's. */
+static shmHandle *_shm_create(char *err, int fd, int mfd, const int *efds, uint32_t size, int server) {
+	shmHandle *sh = calloc(1,sizeof(*sh));
+	struct stat st;
+	shmRing *r0, *r1;
+
+	if( !sh ) {
+		_shm_error(err,"shm: out of memory");
+		return NULL;
+	}
+	sh->fd = fd;
+	sh->efd = SHM_INV;
+	sh->wefd = SHM_INV;
+	sh->rfd = server ? efds[1] : efds[0];
+	sh->wfd = server ? efds[0] : efds[1];
+	sh->sfd = server ? efds[2] : efds[3];
+	sh->pfd = server ? efds[3] : efds[2];
+	sh->spin = SHM_SPIN_MIN;
+	sh->size = size;
+	sh->len = 2 * _shm_ring_len(size);
+
+	if( SHM_ERR == fstat(mfd,&st) || (size_t)st.st_size < sh->len ) {
+		_shm_error(err,"shm: ring file smaller than %zu bytes",sh->len);
+		goto err;
+	}
+
+	sh->map = mmap(NULL,sh->len,PROT_READ|PROT_WRITE,MAP_SHARED,mfd,0);
+	if( MAP_FAILED == sh->map ) {
+		_shm_error(err,"mmap: %s",strerror(errno));
+		sh->map = NULL;
+		goto err;
+	}
+	r0 = sh->map;
+	r1 = (shmRing *)((char *)sh->map + _shm_ring_len(size));
+	sh->wring = server ? r0 : r1;
+	sh->rring = server ? r1 : r0;
+
+	if( SHM_INV == (sh->efd = _shm_watch(err,sh->fd,sh->rfd)) ||
+		SHM_INV == (sh->wefd = _shm_watch(err,sh->fd,sh->sfd)) )
+		goto err;
+	return sh;
+err:
+	if( sh->map )
+		munmap(sh->map,sh->len);
+	SHM_CLOSE(sh->wefd);
+	SHM_CLOSE(sh->efd);
+	SHM_FREE(sh);
+	return NULL;
+}
+
+/* -------------------------------- api implementation ----------------------- */
+
+int shm_server(char *err, const char *path, int backlog) {
+	struct sockaddr_un sa;
+	int s;
+
+	if( strlen(path) >= sizeof(sa.sun_path) ) {
+		_shm_error(err,"shm: path too long");
+		return SHM_ERR;
+	}
+	if( SHM_ERR == (s = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0)) ) {
+		_shm_error(err,"socket: %s",strerror(errno));
+		return SHM_ERR;
+	}
+	memset(&sa,0,sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path,path);
+	unlink(path);
+	if( SHM_ERR == bind(s,(struct sockaddr *)&sa,sizeof(sa)) ) {
+		_shm_error(err,"bind: %s",strerror(errno));
+		goto err;
+	}
+	if( SHM_ERR == listen(s,backlog) ) {
+		_shm_error(err,"listen: %s",strerror(errno));
+		goto err;
+	}
+	return s;
+err:
+	close(s);
+	return SHM_ERR;
+}
+
+/* Accepts a peer on the control socket and sends it the ring memory and the
+ * eventfds. The rings are a power of two of at least size bytes each. */
+shmHandle *shm_accept(char *err, int fd, int size) {
+	int c = SHM_INV, mfd = SHM_INV, efds[SHM_EVENTFDS], i;
+	char ctl[CMSG_SPACE((1 + SHM_EVENTFDS) * sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	uint32_t rsize = 4096;
+	shmHandle *sh;
+	shmRing *r;
+
+	for( i = 0; SHM_EVENTFDS > i; ++i )
+		efds[i] = SHM_INV;
+	while( rsize < (uint32_t)(0 < size ? size : SHM_RING_SIZE) && SHM_RING_MAX > rsize )
+		rsize <<= 1;
+
+	while( SHM_ERR == (c = accept4(fd,NULL,NULL,SOCK_CLOEXEC)) ) {
+		if( EINTR != errno ) {
+			_shm_error(err,"accept: %s",strerror(errno));
+			return NULL;
+		}
+	}
+	if( SHM_ERR == (mfd = memfd_create("shm",MFD_CLOEXEC)) ) {
+		_shm_error(err,"memfd_create: %s",strerror(errno));
+		goto err;
+	}
+	if( SHM_ERR == ftruncate(mfd,2 * _shm_ring_len(rsize)) ) {
+		_shm_error(err,"ftruncate: %s",strerror(errno));
+		goto err;
+	}
+	for( i = 0; SHM_EVENTFDS > i; ++i ) {
+		if( SHM_INV == (efds[i] = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC)) ) {
+			_shm_error(err,"eventfd: %s",strerror(errno));
+			goto err;
+		}
+	}
+
+	memset(&msg,0,sizeof(msg));
+	memset(ctl,0,sizeof(ctl));
+	iov.iov_base = &rsize;
+	iov.iov_len = sizeof(rsize);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl;
+	msg.msg_controllen = sizeof(ctl);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN((1 + SHM_EVENTFDS) * sizeof(int));
+	memcpy(CMSG_DATA(cm),&mfd,sizeof(int));
+	memcpy(CMSG_DATA(cm)+sizeof(int),efds,sizeof(efds));
+
+	if( !(sh = _shm_create(err,c,mfd,efds,rsize,1)) )
+		goto err;
+	r = sh->wring;
+	r->size = rsize;
+	r->sleeping = 1;
+	r = sh->rring;
+	r->size = rsize;
+	r->sleeping = 1;
+
+	while( SHM_ERR == sendmsg(c,&msg,MSG_NOSIGNAL) ) {
+		if( EINTR != errno ) {
+			_shm_error(err,"sendmsg: %s",strerror(errno));
+			close(mfd);
+			shm_close(sh);
+			return NULL;
+		}
+	}
+	close(mfd);
+	return sh;
+err:
+	for( i = 0; SHM_EVENTFDS > i; ++i )
+		SHM_CLOSE(efds[i]);
+	SHM_CLOSE(mfd);
+	SHM_CLOSE(c);
+	return NULL;
+}
+
+shmHandle *shm_connect(char *err, const char *path) {
+	char ctl[CMSG_SPACE((1 + SHM_EVENTFDS) * sizeof(int))];
+	struct sockaddr_un sa;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	uint32_t rsize = 0;
+	int c, i, fds[1 + SHM_EVENTFDS];
+	shmHandle *sh;
+
+	if( strlen(path) >= sizeof(sa.sun_path) ) {
+		_shm_error(err,"shm: path too long");
+		return NULL;
+	}
+	if( SHM_ERR == (c = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0)) ) {
+		_shm_error(err,"socket: %s",strerror(errno));
+		return NULL;
+	}
+	memset(&sa,0,sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path,path);
+	if( SHM_ERR == connect(c,(struct sockaddr *)&sa,sizeof(sa)) ) {
+		_shm_error(err,"connect: %s",strerror(errno));
+		goto err;
+	}
+
+	memset(&msg,0,sizeof(msg));
+	iov.iov_base = &rsize;
+	iov.iov_len = sizeof(rsize);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl;
+	msg.msg_controllen = sizeof(ctl);
+	while( sizeof(rsize) != recvmsg(c,&msg,MSG_CMSG_CLOEXEC|MSG_WAITALL) ) {
+		if( EINTR != errno ) {
+			_shm_error(err,"recvmsg: %s",errno ? strerror(errno) : "handshake failed");
+			goto err;
+		}
+	}
+	cm = CMSG_FIRSTHDR(&msg);
+	if( !cm || SCM_RIGHTS != cm->cmsg_type || CMSG_LEN(sizeof(fds)) != cm->cmsg_len ) {
+		_shm_error(err,"shm: bad handshake");
+		goto err;
+	}
+	memcpy(fds,CMSG_DATA(cm),sizeof(fds));
+
+	if( !rsize || (rsize & (rsize - 1)) || SHM_RING_MAX < rsize ) {
+		_shm_error(err,"shm: bad ring size %u",rsize);
+		for( i = 0; 1 + SHM_EVENTFDS > i; ++i )
+			close(fds[i]);
+		goto err;
+	}
+	sh = _shm_create(err,c,fds[0],fds+1,rsize,0);
+	close(fds[0]);
+	if( sh )
+		return sh;
+	for( i = 1; 1 + SHM_EVENTFDS > i; ++i )
+		close(fds[i]);
+err:
+	close(c);
+	return NULL;
+}
+
+void shm_close(shmHandle *sh) {
+	__atomic_store_n(&sh->wring->closed,1,__ATOMIC_SEQ_CST);
+	__atomic_store_n(&sh->rring->closed,1,__ATOMIC_SEQ_CST);
+	_shm_notify(sh->wfd);
+	_shm_notify(sh->pfd);
+	munmap(sh->map,sh->len);
+	SHM_CLOSE(sh->wefd);
+	SHM_CLOSE(sh->efd);
+	SHM_CLOSE(sh->rfd);
+	SHM_CLOSE(sh->wfd);
+	SHM_CLOSE(sh->sfd);
+	SHM_CLOSE(sh->pfd);
+	SHM_CLOSE(sh->fd);
+	SHM_FREE(sh);
+}
+
+/* Returns the descriptor to register with el for EL_READABLE. It fires when
+ * the peer has written and was told we sleep, or when the peer went away. */
+int shm_fd(shmHandle *sh) {
+	return sh->efd;
+}
+
+/* Returns the descriptor to register with el for EL_READABLE while shm_write
+ * reports SHM_AGAIN, the way a socket is armed for EL_WRITABLE. It fires when
+ * the peer has freed room, or when the peer went away. */
+int shm_write_fd(shmHandle *sh) {
+	return sh->wefd;
+}
+
+/* Reads up to count - *len bytes into buf + *len. When the ring runs dry the
+ * reader spins for a while before telling the writer to notify it, and the
+ * spin budget grows when data shows up in time and shrinks when it doesn't. */
+int shm_read(char *err, shmHandle *sh, char *buf, int count, int *len) {
+	shmRing *r = sh->rring;
+	uint32_t size = sh->size;
+	int drained = 0;
+
+	while( count > *len ) {
+		uint32_t avail = _shm_ring_avail(r,size), off, n, i;
+
+		if( !avail ) {
+			for( i = 0; (uint32_t)sh->spin > i && !avail; ++i ) {
+				SHM_PAUSE();
+				avail = _shm_ring_avail(r,size);
+			}
+			if( avail ) {
+				if( SHM_SPIN_MAX > sh->spin )
+					sh->spin *= 2;
+			} else {
+				if( SHM_SPIN_MIN < sh->spin )
+					sh->spin /= 2;
+				if( !_shm_drain(sh->rfd) && !__atomic_load_n(&r->closed,__ATOMIC_ACQUIRE) &&
+					_shm_peer_gone(sh) )
+					__atomic_store_n(&r->closed,1,__ATOMIC_RELEASE);
+				drained = 1;
+				__atomic_store_n(&r->sleeping,1,__ATOMIC_SEQ_CST);
+				if( !(avail = _shm_ring_avail(r,size)) ) {
+					if( __atomic_load_n(&r->closed,__ATOMIC_ACQUIRE) ) {
+						_shm_error(err,"shm: peer closed");
+						return SHM_DISCONNECT;
+					}
+					return SHM_OK;
+				}
+				__atomic_store_n(&r->sleeping,0,__ATOMIC_SEQ_CST);
+			}
+		}
+
+		n = (uint32_t)(count - *len) < avail ? (uint32_t)(count - *len) : avail;
+		off = r->head & (size - 1);
+		if( n > size - off ) {
+			memcpy(buf+*len,r->data+off,size-off);
+			memcpy(buf+*len+size-off,r->data,n-(size-off));
+		} else {
+			memcpy(buf+*len,r->data+off,n);
+		}
+		__atomic_store_n(&r->head,r->head+n,__ATOMIC_SEQ_CST);
+		*len += n;
+
+		if( __atomic_load_n(&r->waiting,__ATOMIC_SEQ_CST) &&
+			__atomic_exchange_n(&r->waiting,0,__ATOMIC_SEQ_CST) )
+			_shm_notify(sh->pfd);
+	}
+	if( drained && _shm_ring_avail(r,size) )
+		_shm_notify(sh->rfd);
+	return SHM_OK;
+}
+
+/* Copies buf + *len up to count into the ring, advancing *len, and notifies
+ * the reader only if it sleeps. Never waits: when the ring fills it returns
+ * SHM_AGAIN, and shm_write_fd turns readable once the reader frees room. */
+int shm_write(char *err, shmHandle *sh, char *buf, int count, int *len) {
+	shmRing *r = sh->wring;
+	uint32_t size = sh->size;
+
+	while( count > *len ) {
+		uint64_t head = __atomic_load_n(&r->head,__ATOMIC_SEQ_CST);
+		uint64_t used = r->tail - head;
+		uint32_t room = used < size ? size - (uint32_t)used : 0, off, n;
+
+		if( __atomic_load_n(&r->closed,__ATOMIC_ACQUIRE) ) {
+			_shm_error(err,"shm: peer closed");
+			return SHM_DISCONNECT;
+		}
+		if( !room ) {
+			/* Publish waiting before the last look at head, the reader
+			 * advances head before it looks at waiting. */
+			_shm_drain(sh->sfd);
+			__atomic_store_n(&r->waiting,1,__ATOMIC_SEQ_CST);
+			if( r->tail - __atomic_load_n(&r->head,__ATOMIC_SEQ_CST) < size )
+				continue;
+			if( _shm_peer_gone(sh) ) {
+				__atomic_store_n(&r->closed,1,__ATOMIC_RELEASE);
+				continue;
+			}
+			return SHM_AGAIN;
+		}
+
+		n = (uint32_t)(count - *len) < room ? (uint32_t)(count - *len) : room;
+		off = r->tail & (size - 1);
+		if( n > size - off ) {
+			memcpy(r->data+off,buf+*len,size-off);
+			memcpy(r->data,buf+*len+size-off,n-(size-off));
+		} else {
+			memcpy(r->data+off,buf+*len,n);
+		}
+		__atomic_store_n(&r->tail,r->tail+n,__ATOMIC_SEQ_CST);
+		*len += n;
+
+		if( __atomic_exchange_n(&r->sleeping,0,__ATOMIC_SEQ_CST) )
+			_shm_notify(sh->wfd);
+	}
+	return SHM_OK;
+}
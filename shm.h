@@ -0,0 +1,73 @@
+/* Shared Memory Ring Transport.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ */
+
+#ifndef __SHM_H_
+#define __SHM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* -------------------------------- struct ----------------------------------- */
+
+typedef struct shmRing {
+	uint64_t head;
+	char pad0[56];
+	uint64_t tail;
+	char pad1[56];
+	uint32_t sleeping;
+	uint32_t waiting;
+	uint32_t closed;
+	uint32_t size;
+	char pad2[48];
+	char data[];
+} shmRing;
+
+typedef struct shmHandle {
+	int fd;
+	int efd;
+	int rfd;
+	int wfd;
+	int sfd;
+	int pfd;
+	int wefd;
+	int spin;
+	uint32_t size;
+	size_t len;
+	shmRing *rring;
+	shmRing *wring;
+	void *map;
+} shmHandle;
+
+/* -------------------------------- define ----------------------------------- */
+
+#define SHM_OK 0
+#define SHM_ERR -1
+
+#define SHM_DISCONNECT 1
+#define SHM_AGAIN 2
+
+#define SHM_RING_SIZE (1024 * 1024)
+#define SHM_RING_MAX (1U << 30)
+
+/* -------------------------------- api functions ---------------------------- */
+
+int shm_server(char *err, const char *path, int backlog);
+shmHandle *shm_accept(char *err, int fd, int size);
+shmHandle *shm_connect(char *err, const char *path);
+void shm_close(shmHandle *sh);
+int shm_fd(shmHandle *sh);
+int shm_write_fd(shmHandle *sh);
+int shm_read(char *err, shmHandle *sh, char *buf, int count, int *len);
+int shm_write(char *err, shmHandle *sh, char *buf, int count, int *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SHM_H_ */
@@ -0,0 +1,117 @@
+/* Event Loop Trace Decoder.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ *
+ *   cc -O2 -I.. -o eltrace eltrace.c
+ *   ./eltrace [dump] > trace.json
+ *
+ * Reads dumps written by el_trace_dump (from the file named, or stdin) and
+ * prints them as Chrome trace-event JSON for chrome://tracing or Perfetto.
+ * Each epoll_wait becomes a span, each fd dispatch and timer a complete
+ * event with its duration, and el_file_add/el_file_del instant events.
+ * Timestamps are in microseconds from the first record.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "el.h"
+
+/* -------------------------------- define ----------------------------------- */
+
+#define ELTRACE_BATCH 1024
+
+/* -------------------------------- private ---------------------------------- */
+
+static const char *_eltrace_mask(int mask);
+static void _eltrace_print(elTraceRecord *r, long long base, int *first);
+
+/* -------------------------------- private implementation ------------------- */
+
+static const char *_eltrace_mask(int mask) {
+	static const char *names[] = { "", "r", "w", "rw", "f", "rf", "wf", "rwf" };
+	return names[mask & EL_ALLABLE];
+}
+
+static void _eltrace_print(elTraceRecord *r, long long base, int *first) {
+	double ts = (r->ts - base) / 1000.0;
+	double dur = r->dur / 1000.0;
+
+	printf("%s\n",*first ? "" : ",");
+	*first = 0;
+	switch( r->type ) {
+	case EL_TRACE_ENTER:
+		printf("{\"name\":\"epoll_wait\",\"ph\":\"B\",\"pid\":1,\"tid\":1,\"ts\":%.3f,"
+			"\"args\":{\"timeout\":%lld}}",ts,r->id);
+		break;
+	case EL_TRACE_EXIT:
+		printf("{\"name\":\"epoll_wait\",\"ph\":\"E\",\"pid\":1,\"tid\":1,\"ts\":%.3f,"
+			"\"args\":{\"ready\":%lld}}",ts,r->id);
+		break;
+	case EL_TRACE_FILE:
+		printf("{\"name\":\"fd %lld\",\"cat\":\"file\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+			"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"mask\":\"%s\"}}",
+			r->id,ts,dur,_eltrace_mask(r->mask));
+		break;
+	case EL_TRACE_TIME:
+		printf("{\"name\":\"timer %lld\",\"cat\":\"time\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+			"\"ts\":%.3f,\"dur\":%.3f}",r->id,ts,dur);
+		break;
+	case EL_TRACE_ADD:
+	case EL_TRACE_DEL:
+		printf("{\"name\":\"%s fd %lld\",\"cat\":\"file\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,"
+			"\"tid\":1,\"ts\":%.3f,\"args\":{\"mask\":\"%s\"}}",
+			EL_TRACE_ADD == r->type ? "add" : "del",r->id,ts,_eltrace_mask(r->mask));
+		break;
+	default:
+		printf("{\"name\":\"unknown %d\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":1,"
+			"\"ts\":%.3f}",r->type,ts);
+		break;
+	}
+}
+
+/* -------------------------------- main ------------------------------------- */
+
+int main(int argc, char **argv) {
+	elTraceRecord records[ELTRACE_BATCH];
+	elTraceHeader hdr;
+	long long base = -1;
+	int first = 1;
+	FILE *fp = stdin;
+
+	if( 1 < argc && !(fp = fopen(argv[1],"rb")) ) {
+		fprintf(stderr,"eltrace: cannot open %s\n",argv[1]);
+		return 1;
+	}
+
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	while( 1 == fread(&hdr,sizeof(hdr),1,fp) ) {
+		long long left = hdr.count;
+
+		if( memcmp(hdr.magic,EL_TRACE_MAGIC,sizeof(hdr.magic)) ) {
+			fprintf(stderr,"eltrace: bad dump header\n");
+			break;
+		}
+		while( 0 < left ) {
+			size_t want = ELTRACE_BATCH < left ? ELTRACE_BATCH : (size_t)left;
+			size_t n = fread(records,sizeof(*records),want,fp), i;
+
+			for( i = 0; n > i; ++i ) {
+				if( 0 > base )
+					base = records[i].ts;
+				_eltrace_print(&records[i],base,&first);
+			}
+			if( n != want ) {
+				fprintf(stderr,"eltrace: truncated dump\n");
+				left = 0;
+				break;
+			}
+			left -= n;
+		}
+	}
+	printf("\n]}\n");
+
+	if( stdin != fp )
+		fclose(fp);
+	return 0;
+}